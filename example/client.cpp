@@ -1,6 +1,7 @@
 #include <iostream>
 
 #include "remote/client.h"
+#include "remote/trace.h"
 #include "coke/coke.h"
 
 using Arg = remote::Arg;
@@ -14,7 +15,8 @@ coke::Task<void> set_value(remote::Client &cli) {
     auto [state, error] = co_await cli.call(m);
 
     if (state != coke::STATE_SUCCESS) {
-        std::cerr << "Error: " << state << ' ' << error << std::endl;
+        std::cerr << "Error: " << state << ' ' << error << ' '
+                  << m.get_error() << std::endl;
     }
     else {
         std::cout << "Set value success" << std::endl;
@@ -34,10 +36,12 @@ coke::Task<void> add_value(remote::Client &cli) {
     m.remote("kv/set", "sum", m.remote("kedixa/to_string", arg_sum));
     m.set_return_args(arg_sum);
 
-    auto [state, error] = co_await cli.call(m);
+    remote::TraceContext trace{.trace_id = 1, .sampled = true};
+    auto [state, error] = co_await cli.call(m, trace);
 
     if (state != coke::STATE_SUCCESS) {
-        std::cerr << "Error: " << state << ' ' << error << std::endl;
+        std::cerr << "Error: " << state << ' ' << error << ' '
+                  << m.get_error() << std::endl;
     }
     else {
         int sum = m.get_return_value<int>(arg_sum);
@@ -57,10 +61,11 @@ coke::Task<void> append(remote::Client &cli) {
     auto [state, error] = co_await cli.call(m);
 
     if (state != coke::STATE_SUCCESS) {
-        std::cerr << "Error: " << state << ' ' << error << std::endl;
+        std::cerr << "Error: " << state << ' ' << error << ' '
+                  << m.get_error() << std::endl;
     }
     else {
-        auto ref = m.get_return_value<std::string>(arg_ref);
+        auto ref = m.get_return_value<std::string_view>(arg_ref);
         std::cout << "Append success, ref " << std::quoted(ref) << std::endl;
     }
 }
@@ -74,7 +79,8 @@ coke::Task<void> no_param(remote::Client &cli) {
     auto [state, error] = co_await cli.call(m);
 
     if (state != coke::STATE_SUCCESS) {
-        std::cerr << "Error: " << state << ' ' << error << std::endl;
+        std::cerr << "Error: " << state << ' ' << error << ' '
+                  << m.get_error() << std::endl;
     }
     else {
         std::size_t id = m.get_return_value<std::size_t>(arg_id);
@@ -105,7 +111,8 @@ coke::Task<void> loop(remote::Client &cli) {
 
     auto [state, error] = co_await cli.call(m);
     if (state != coke::STATE_SUCCESS) {
-        std::cerr << "Error: " << state << ' ' << error << std::endl;
+        std::cerr << "Error: " << state << ' ' << error << ' '
+                  << m.get_error() << std::endl;
     }
     else {
         int a = m.get_return_value<int>(arg_a);
@@ -114,6 +121,65 @@ coke::Task<void> loop(remote::Client &cli) {
     }
 }
 
+coke::Task<void> stream(remote::Client &cli) {
+    remote::CommandBuilder m;
+    remote::Stream s;
+
+    Arg arg_a = m.arg(0);
+    Arg arg_c = m.arg(5);
+
+    m.remote_while([&] {
+        return m.remote("kedixa/integer_less", arg_a, arg_c);
+    }, [&] {
+        arg_a = m.remote("kedixa/add", arg_a, 1);
+        m.remote_emit(arg_a);
+    });
+
+    m.set_return_args(arg_a);
+
+    auto [state, error] = co_await cli.open_stream(m, s);
+    if (state != coke::STATE_SUCCESS) {
+        std::cerr << "Error: " << state << ' ' << error << ' '
+                  << s.get_error() << std::endl;
+        co_return;
+    }
+
+    while (co_await s.next())
+        std::cout << "stream chunk " << s.get<int>() << std::endl;
+
+    if (!s.get_error().empty()) {
+        std::cerr << "Stream error: " << s.get_error() << std::endl;
+    }
+    else if (s.get_status().first != coke::STATE_SUCCESS) {
+        std::cerr << "Error: " << s.get_status().first << ' '
+                  << s.get_status().second << std::endl;
+    }
+    else {
+        int a = m.get_return_value<int>(arg_a);
+        std::cout << "stream success, a = " << a << std::endl;
+    }
+}
+
+coke::Task<void> trace(remote::Client &cli) {
+    remote::CommandBuilder m;
+
+    Arg arg_spans = m.remote("remote/trace", (uint64_t)1);
+    m.set_return_args(arg_spans);
+
+    auto [state, error] = co_await cli.call(m);
+    if (state != coke::STATE_SUCCESS) {
+        std::cerr << "Error: " << state << ' ' << error << ' '
+                  << m.get_error() << std::endl;
+    }
+    else {
+        auto spans = m.get_return_value<std::vector<remote::TraceSpan>>(arg_spans);
+        for (const auto &span : spans) {
+            std::cout << "trace span " << span.name << ' '
+                      << span.duration << "ns" << std::endl;
+        }
+    }
+}
+
 coke::Task<void> call_remote(remote::Client &cli) {
     co_await set_value(cli);
     co_await add_value(cli);
@@ -123,6 +189,8 @@ coke::Task<void> call_remote(remote::Client &cli) {
     co_await no_param(cli);
 
     co_await loop(cli);
+    co_await stream(cli);
+    co_await trace(cli);
 }
 
 int main() {
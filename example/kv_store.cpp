@@ -0,0 +1,491 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kv_store.h"
+
+namespace {
+
+constexpr char SNAPSHOT_MAGIC[8] = {'R', 'K', 'V', 'S', 'N', 'A', 'P', '1'};
+constexpr std::size_t HEADER_SIZE = 8 + 8 + 8;
+constexpr std::size_t RECORD_HEAD = 4 + 4;
+constexpr std::size_t LOG_HEAD = 1 + 4 + 4;
+
+constexpr char OP_SET = 1;
+constexpr char OP_DEL = 2;
+
+template<typename T>
+T load(const char *p) {
+    T x;
+    std::memcpy(&x, p, sizeof(T));
+    return x;
+}
+
+template<typename T>
+void store(std::string &buf, T x) {
+    buf.append((const char *)&x, sizeof(T));
+}
+
+bool write_all(int fd, const char *p, std::size_t n) {
+    while (n > 0) {
+        ssize_t ret = ::write(fd, p, n);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        p += ret;
+        n -= ret;
+    }
+
+    return true;
+}
+
+} // namespace
+
+bool KvStore::open(const std::string &dir) {
+    std::lock_guard<std::mutex> lg(mtx);
+
+    if (log_fd >= 0)
+        return false;
+
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+        return false;
+
+    Snapshot s;
+    Delta f, d;
+
+    // A log left by an interrupted compaction is older than the log.
+    if (!map_snapshot(dir + "/snapshot", s) ||
+        !replay_log(dir + "/log.compact", f) ||
+        !replay_log(dir + "/log", d))
+    {
+        unmap_snapshot(s);
+        return false;
+    }
+
+    int fd = ::open((dir + "/log").c_str(), O_WRONLY | O_CREAT | O_APPEND,
+                    0644);
+    if (fd < 0) {
+        unmap_snapshot(s);
+        return false;
+    }
+
+    this->dir = dir;
+    log_fd = fd;
+    snap = s;
+    frozen = std::move(f);
+    delta = std::move(d);
+    return true;
+}
+
+void KvStore::close() {
+    stop_compaction();
+
+    std::lock_guard<std::mutex> lg(mtx);
+
+    if (log_fd >= 0) {
+        ::close(log_fd);
+        log_fd = -1;
+    }
+
+    unmap_snapshot(snap);
+    frozen.clear();
+    delta.clear();
+}
+
+std::string KvStore::get(const std::string &key) {
+    std::lock_guard<std::mutex> lg(mtx);
+
+    for (const Delta *d : {&delta, &frozen}) {
+        auto it = d->find(key);
+        if (it != d->end())
+            return it->second.value_or(std::string());
+    }
+
+    auto value = snapshot_find(key);
+    return value ? std::string(*value) : std::string();
+}
+
+bool KvStore::set(const std::string &key, const std::string &value) {
+    std::lock_guard<std::mutex> lg(mtx);
+
+    if (!append_log(OP_SET, key, value))
+        return false;
+
+    delta.insert_or_assign(key, value);
+    return true;
+}
+
+bool KvStore::del(const std::string &key) {
+    std::lock_guard<std::mutex> lg(mtx);
+
+    if (!append_log(OP_DEL, key, std::string_view()))
+        return false;
+
+    delta.insert_or_assign(key, std::nullopt);
+    return true;
+}
+
+/**
+ * The log is renamed to log.compact and the delta frozen, then the frozen
+ * delta is merged with the old snapshot without holding the lock. Readers
+ * keep using the old snapshot until the new one is renamed into place.
+ */
+bool KvStore::compact() {
+    std::lock_guard<std::mutex> clg(compact_mtx);
+    std::string log_path, compact_path;
+
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+
+        if (log_fd < 0)
+            return false;
+
+        if (delta.empty() && frozen.empty())
+            return true;
+
+        log_path = dir + "/log";
+        compact_path = dir + "/log.compact";
+
+        // A frozen delta left by open() or by a failed compaction is
+        // merged first, its log is still log.compact.
+        if (frozen.empty()) {
+            if (rename(log_path.c_str(), compact_path.c_str()) < 0)
+                return false;
+
+            int fd = ::open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND,
+                            0644);
+            if (fd < 0) {
+                rename(compact_path.c_str(), log_path.c_str());
+                return false;
+            }
+
+            ::close(log_fd);
+            log_fd = fd;
+            frozen = std::move(delta);
+            delta.clear();
+        }
+    }
+
+    std::string snap_path = dir + "/snapshot";
+    std::string tmp_path = dir + "/snapshot.tmp";
+    Snapshot s;
+
+    if (!write_snapshot(tmp_path, frozen) ||
+        rename(tmp_path.c_str(), snap_path.c_str()) < 0 ||
+        !map_snapshot(snap_path, s))
+    {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+
+        unmap_snapshot(snap);
+        snap = s;
+        frozen.clear();
+    }
+
+    // The rename must reach the disk before the log it replaces is removed.
+    if (!sync_dir())
+        return false;
+
+    unlink(compact_path.c_str());
+    return true;
+}
+
+void KvStore::start_compaction(std::chrono::seconds interval) {
+    stop_compaction();
+
+    compact_stop = false;
+    compact_thread = std::thread([this, interval] {
+        std::unique_lock<std::mutex> lk(mtx);
+
+        while (!compact_cv.wait_for(lk, interval, [this] {
+            return compact_stop;
+        })) {
+            lk.unlock();
+            compact();
+            lk.lock();
+        }
+    });
+}
+
+void KvStore::stop_compaction() {
+    if (!compact_thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lg(mtx);
+        compact_stop = true;
+    }
+
+    compact_cv.notify_all();
+    compact_thread.join();
+}
+
+bool KvStore::map_snapshot(const std::string &path, Snapshot &s) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+
+    s = Snapshot();
+
+    if (fd < 0)
+        return errno == ENOENT;
+
+    if (fstat(fd, &st) < 0 || (std::size_t)st.st_size < HEADER_SIZE) {
+        ::close(fd);
+        return false;
+    }
+
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (p == MAP_FAILED)
+        return false;
+
+    s.data = (const char *)p;
+    s.size = st.st_size;
+    s.count = load<uint64_t>(s.data + 8);
+    s.table_off = load<uint64_t>(s.data + 16);
+
+    if (std::memcmp(s.data, SNAPSHOT_MAGIC, 8) != 0 ||
+        s.table_off < HEADER_SIZE || s.table_off > s.size ||
+        s.count > (s.size - s.table_off) / 8)
+    {
+        unmap_snapshot(s);
+        return false;
+    }
+
+    return true;
+}
+
+void KvStore::unmap_snapshot(Snapshot &s) {
+    if (s.data)
+        munmap((void *)s.data, s.size);
+
+    s = Snapshot();
+}
+
+std::optional<std::string_view>
+KvStore::snapshot_find(std::string_view key) const {
+    uint64_t lo = 0, hi = snap.count;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        uint64_t off = load<uint64_t>(snap.data + snap.table_off + mid * 8);
+
+        if (off > snap.table_off || snap.table_off - off < RECORD_HEAD)
+            return std::nullopt;
+
+        uint32_t klen = load<uint32_t>(snap.data + off);
+        uint32_t vlen = load<uint32_t>(snap.data + off + 4);
+
+        if (snap.table_off - off - RECORD_HEAD < (uint64_t)klen + vlen)
+            return std::nullopt;
+
+        std::string_view k(snap.data + off + RECORD_HEAD, klen);
+        int cmp = k.compare(key);
+
+        if (cmp == 0)
+            return std::string_view(snap.data + off + RECORD_HEAD + klen, vlen);
+        else if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return std::nullopt;
+}
+
+// Replay the log into `d`, a torn record at the end is cut off.
+bool KvStore::replay_log(const std::string &path, Delta &d) {
+    int fd = ::open(path.c_str(), O_RDWR);
+    struct stat st;
+
+    if (fd < 0)
+        return errno == ENOENT;
+
+    if (fstat(fd, &st) < 0) {
+        ::close(fd);
+        return false;
+    }
+
+    std::string buf(st.st_size, '\0');
+    std::size_t n = 0;
+
+    while (n < buf.size()) {
+        ssize_t ret = ::read(fd, buf.data() + n, buf.size() - n);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+
+        n += ret;
+    }
+
+    std::size_t off = 0;
+    while (n - off >= LOG_HEAD) {
+        char op = buf[off];
+        uint32_t klen = load<uint32_t>(buf.data() + off + 1);
+        uint32_t vlen = load<uint32_t>(buf.data() + off + 5);
+
+        if (n - off - LOG_HEAD < (std::size_t)klen + vlen)
+            break;
+
+        std::string key(buf.data() + off + LOG_HEAD, klen);
+
+        if (op == OP_SET)
+            d.insert_or_assign(std::move(key),
+                std::string(buf.data() + off + LOG_HEAD + klen, vlen));
+        else if (op == OP_DEL)
+            d.insert_or_assign(std::move(key), std::nullopt);
+        else
+            break;
+
+        off += LOG_HEAD + klen + vlen;
+    }
+
+    if (off < (std::size_t)st.st_size && ftruncate(fd, off) < 0) {
+        ::close(fd);
+        return false;
+    }
+
+    ::close(fd);
+    return true;
+}
+
+// Append one record to the log, a partly written record is cut off again so
+// that later records are not lost behind it on replay.
+bool KvStore::append_log(char op, std::string_view key,
+                         std::string_view value) {
+    if (log_fd < 0)
+        return true;
+
+    struct stat st;
+    if (fstat(log_fd, &st) < 0)
+        return false;
+
+    std::string buf;
+    buf.reserve(LOG_HEAD + key.size() + value.size());
+
+    buf.push_back(op);
+    store<uint32_t>(buf, key.size());
+    store<uint32_t>(buf, value.size());
+    buf.append(key);
+    buf.append(value);
+
+    if (!write_all(log_fd, buf.data(), buf.size())) {
+        if (ftruncate(log_fd, st.st_size) < 0)
+            perror("kv log");
+
+        return false;
+    }
+
+    return true;
+}
+
+bool KvStore::sync_dir() {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return false;
+
+    bool ok = fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+/**
+ * Merge the current snapshot with `d` into a new snapshot file. Records are
+ * written in key order first, followed by the table of record offsets which
+ * lookups search in place.
+ */
+bool KvStore::write_snapshot(const std::string &path, const Delta &d) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+
+    std::vector<uint64_t> offsets;
+    std::string buf(HEADER_SIZE, '\0');
+    uint64_t pos = 0;
+    bool ok = true;
+
+    auto flush = [&] (bool force) {
+        if (ok && (force || buf.size() >= 1024 * 1024)) {
+            ok = write_all(fd, buf.data(), buf.size());
+            pos += buf.size();
+            buf.clear();
+        }
+    };
+
+    auto add = [&] (std::string_view key, std::string_view value) {
+        offsets.push_back(pos + buf.size());
+        store<uint32_t>(buf, key.size());
+        store<uint32_t>(buf, value.size());
+        buf.append(key);
+        buf.append(value);
+        flush(false);
+    };
+
+    uint64_t i = 0;
+    auto it = d.begin();
+
+    while (ok && (i < snap.count || it != d.end())) {
+        std::string_view key, value;
+
+        if (i < snap.count) {
+            uint64_t off = load<uint64_t>(snap.data + snap.table_off + i * 8);
+            uint32_t klen = load<uint32_t>(snap.data + off);
+            uint32_t vlen = load<uint32_t>(snap.data + off + 4);
+
+            key = std::string_view(snap.data + off + RECORD_HEAD, klen);
+            value = std::string_view(snap.data + off + RECORD_HEAD + klen,
+                                     vlen);
+        }
+
+        int cmp = (i == snap.count) ? 1 :
+                  (it == d.end()) ? -1 : key.compare(it->first);
+
+        if (cmp < 0) {
+            add(key, value);
+            ++i;
+            continue;
+        }
+
+        if (cmp == 0)
+            ++i;
+
+        if (it->second)
+            add(it->first, *(it->second));
+
+        ++it;
+    }
+
+    uint64_t table_off = pos + buf.size();
+    for (uint64_t off : offsets)
+        store<uint64_t>(buf, off);
+
+    flush(true);
+
+    std::string header(SNAPSHOT_MAGIC, 8);
+    store<uint64_t>(header, offsets.size());
+    store<uint64_t>(header, table_off);
+
+    ok = ok && pwrite(fd, header.data(), header.size(), 0) ==
+               (ssize_t)header.size();
+    ok = ok && fsync(fd) == 0;
+
+    ::close(fd);
+    return ok;
+}
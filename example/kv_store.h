@@ -0,0 +1,83 @@
+#ifndef REMOTE_EXAMPLE_KV_STORE_H
+#define REMOTE_EXAMPLE_KV_STORE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+
+/**
+ * Key value store of the example server. Without open() it is in memory
+ * only, otherwise the data is kept in `dir` as
+ *
+ *   snapshot      sorted records, memory mapped and searched in place
+ *   log           set/del operations appended after the snapshot
+ *   log.compact   log being merged into the next snapshot
+ *
+ * so opening a store costs a mapping and a replay of the short log. Integers
+ * in the files are in native byte order.
+ */
+class KvStore {
+    // Changed keys, std::nullopt marks a deleted key.
+    using Delta = std::map<std::string, std::optional<std::string>, std::less<>>;
+
+    struct Snapshot {
+        const char *data{nullptr};
+        std::size_t size{0};
+        uint64_t count{0};
+        uint64_t table_off{0};
+    };
+
+public:
+    KvStore() = default;
+    ~KvStore() { close(); }
+
+    KvStore(const KvStore &) = delete;
+    KvStore &operator=(const KvStore &) = delete;
+
+    bool open(const std::string &dir);
+    void close();
+
+    std::string get(const std::string &key);
+    // Return false if the operation could not be written to the log, the
+    // store is left unchanged then.
+    bool set(const std::string &key, const std::string &value);
+    bool del(const std::string &key);
+
+    // Merge the log into a new snapshot.
+    bool compact();
+
+    void start_compaction(std::chrono::seconds interval);
+    void stop_compaction();
+
+private:
+    bool map_snapshot(const std::string &path, Snapshot &snap);
+    void unmap_snapshot(Snapshot &snap);
+    std::optional<std::string_view> snapshot_find(std::string_view key) const;
+    bool replay_log(const std::string &path, Delta &delta);
+    bool append_log(char op, std::string_view key, std::string_view value);
+    bool write_snapshot(const std::string &path, const Delta &delta);
+    bool sync_dir();
+
+private:
+    std::mutex mtx;
+    std::mutex compact_mtx;
+    std::string dir;
+    int log_fd{-1};
+
+    Snapshot snap;
+    Delta frozen;
+    Delta delta;
+
+    std::thread compact_thread;
+    std::condition_variable compact_cv;
+    bool compact_stop{false};
+};
+
+#endif // REMOTE_EXAMPLE_KV_STORE_H
@@ -1,53 +1,209 @@
 #include <atomic>
 #include <csignal>
+#include <cstdlib>
+#include <iomanip>
 #include <iostream>
+#include <memory>
 #include <string>
-#include <map>
-#include <mutex>
 
+#include "kv_store.h"
+#include "remote/arena.h"
 #include "remote/function_manager.h"
 #include "remote/server.h"
+#include "remote/single_flight.h"
+#include "remote/stream.h"
 #include "coke/coke.h"
 
 std::atomic<bool> run_flag{true};
 
-std::map<std::string, std::string> kv;
-std::mutex kv_mtx;
+KvStore kv;
 std::atomic<std::size_t> id{0};
 
 remote::FunctionManager fm;
+remote::SingleFlight flights;
+remote::StreamRegistry streams;
+bool coalesce = false;
 
 void sighandler(int) {
     run_flag.store(false, std::memory_order_relaxed);
     run_flag.notify_all();
 }
 
+void decode_program(const std::string &input, remote::DataMap &data,
+                    std::pmr::vector<remote::Command> &cmds,
+                    std::pmr::vector<remote::ArgID> &return_ids,
+                    remote::CallMeta &meta) {
+    // Decoded objects are only needed until they are converted, so every
+    // request on this thread reuses one zone, whose first chunk is kept.
+    thread_local msgpack::zone zone(64 * 1024);
+    std::size_t off = 0;
+    bool referenced;
+    auto unpack = [&] () {
+        return msgpack::unpack(zone, input.data(), input.size(), off,
+                               referenced, remote::unpack_reference);
+    };
+
+    zone.clear();
+    unpack().convert(data);
+    unpack().convert(cmds);
+    unpack().convert(return_ids);
+
+    if (off < input.size())
+        unpack().convert(meta);
+}
+
+coke::Task<std::string> execute(remote::DataMap &data,
+                                std::span<const remote::Command> cmds,
+                                std::span<const remote::ArgID> return_ids,
+                                remote::CallMeta meta,
+                                remote::FunctionManager::ChunkSink sink = nullptr) {
+    uint64_t trace_id = meta.trace_id;
+    bool sampled = meta.sampled;
+
+    co_await fm.invoke(data, cmds, std::move(meta), std::move(sink));
+
+    uint64_t start = sampled ? remote::Tracer::now() : 0;
+    std::string str;
+    remote::PackStream stream(str);
+    msgpack::packer<remote::PackStream<>> pk(stream);
+
+    pk.pack_map(return_ids.size());
+    for (auto ret_id : return_ids) {
+        pk.pack(ret_id);
+        pk.pack(data[ret_id]);
+    }
+
+    if (sampled)
+        remote::Tracer::instance().record(trace_id, "encode", start,
+                                          remote::Tracer::now());
+
+    co_return str;
+}
+
+coke::Task<std::string> call(const std::string &input, bool sampled) {
+    // Everything decoded from the request lives in the arena, str objects
+    // refer to the input and are copied into the arena only once.
+    remote::Arena arena;
+    remote::DataMap data(&arena);
+    std::pmr::vector<remote::Command> cmds(&arena);
+    std::pmr::vector<remote::ArgID> return_ids(&arena);
+    remote::CallMeta meta;
+
+    uint64_t start = sampled ? remote::Tracer::now() : 0;
+    decode_program(input, data, cmds, return_ids, meta);
+
+    if (sampled)
+        remote::Tracer::instance().record(meta.trace_id, "decode", start,
+                                          remote::Tracer::now());
+
+    if (coalesce && fm.is_read_only(cmds)) {
+        co_return co_await flights.run(input, [&] () {
+            return execute(data, cmds, return_ids, std::move(meta));
+        });
+    }
+
+    co_return co_await execute(data, cmds, return_ids, std::move(meta));
+}
+
+coke::Task<> run_stream(std::shared_ptr<remote::StreamSession> s) {
+    std::string result, error;
+
+    // Let open_stream reply with the stream id first, the program then
+    // goes on from the handler thread queue.
+    co_await coke::sleep(std::chrono::nanoseconds(0));
+
+    auto sink = [s] (const std::pmr::string &value) {
+        return s->push(std::string(value));
+    };
+
+    try {
+        result = co_await execute(s->data, s->cmds, s->return_ids,
+                                  std::move(s->meta), sink);
+    }
+    catch (const std::exception &e) {
+        error = e.what();
+    }
+
+    s->finish(std::move(result), std::move(error));
+}
+
+std::string open_stream(const std::string &input) {
+    auto s = std::make_shared<remote::StreamSession>();
+    decode_program(input, s->data, s->cmds, s->return_ids, s->meta);
+
+    uint64_t sid = streams.add(s);
+    if (sid == 0)
+        throw std::runtime_error("too many streams");
+
+    coke::detach(run_stream(std::move(s)));
+
+    std::string str;
+    remote::PackStream stream(str);
+    msgpack::pack(stream, sid);
+    return str;
+}
+
+coke::Task<std::string> next_stream(const std::string &input) {
+    auto hdl = msgpack::unpack(input.data(), input.size());
+    uint64_t sid = hdl.get().as<uint64_t>();
+    auto s = streams.find(sid);
+
+    if (!s)
+        co_return remote::pack_stream_error("stream not found");
+
+    bool done;
+    std::string str = co_await s->pull(done);
+
+    if (done)
+        streams.erase(sid);
+
+    co_return str;
+}
+
+void close_stream(const std::string &input) {
+    auto hdl = msgpack::unpack(input.data(), input.size());
+    uint64_t sid = hdl.get().as<uint64_t>();
+    auto s = streams.find(sid);
+
+    if (s) {
+        s->close();
+        streams.erase(sid);
+    }
+}
+
 coke::Task<> process(remote::RemoteServerContext ctx) {
     remote::RemoteRequest &req = ctx.get_req();
     remote::RemoteResponse &resp = ctx.get_resp();
     std::string *input = req.get_value();
+    std::string str;
+    int type = req.get_type();
 
-    std::map<remote::ArgID, std::string> data;
-    std::map<remote::ArgID, std::string> return_data;
-    std::vector<remote::Command> cmds;
-    std::vector<remote::ArgID> return_ids;
+    // A failed request is answered with its error message, so that the
+    // client knows why.
+    try {
+        switch (type & remote::MSG_TYPE_MASK) {
+        case remote::MSG_STREAM_OPEN:
+            str = open_stream(*input);
+            break;
 
-    std::size_t off = 0;
-    auto hdl = msgpack::unpack(input->data(), input->size(), off);
-    hdl.get().convert(data);
-    hdl = msgpack::unpack(input->data(), input->size(), off);
-    hdl.get().convert(cmds);
-    hdl = msgpack::unpack(input->data(), input->size(), off);
-    hdl.get().convert(return_ids);
+        case remote::MSG_STREAM_NEXT:
+            str = co_await next_stream(*input);
+            break;
 
-    fm.invoke(data, cmds);
+        case remote::MSG_STREAM_CLOSE:
+            close_stream(*input);
+            break;
 
-    for (auto ret_id : return_ids)
-        return_data[ret_id] = data[ret_id];
+        default:
+            str = co_await call(*input, type & remote::MSG_FLAG_SAMPLED);
+            break;
+        }
+    }
+    catch (const std::exception &e) {
+        str = e.what();
+        resp.set_type(remote::MSG_ERROR);
+    }
 
-    std::string str;
-    remote::PackStream stream(str);
-    msgpack::pack(stream, return_data);
     resp.set_value(std::move(str));
 
     co_return;
@@ -55,44 +211,44 @@ coke::Task<> process(remote::RemoteServerContext ctx) {
 
 void register_functions() {
     fm.add("kv/set", +[](const std::string &key, const std::string &value) {
-        std::lock_guard<std::mutex> lock(kv_mtx);
-        kv[key] = value;
+        if (!kv.set(key, value))
+            throw std::runtime_error("kv write failed");
+
         std::cout << "kv/set: " << key << " " << value << std::endl;
     });
 
     fm.add("kv/get", +[](const std::string &key) {
-        std::lock_guard<std::mutex> lock(kv_mtx);
-        auto it = kv.find(key);
         std::cout << "kv/get: " << key << std::endl;
-        return it == kv.end() ? std::string() : it->second;
-    });
+        return kv.get(key);
+    }, remote::EXEC_INLINE, remote::FUNC_READ_ONLY);
 
     fm.add("kv/del", +[](const std::string &key) {
-        std::lock_guard<std::mutex> lock(kv_mtx);
-        kv.erase(key);
+        if (!kv.del(key))
+            throw std::runtime_error("kv write failed");
+
         std::cout << "kv/del: " << key << std::endl;
     });
 
     fm.add("kedixa/to_int", +[](const std::string &str) {
         std::cout << "kedixa/to_int: " << str << std::endl;
         return std::stoi(str);
-    });
+    }, remote::EXEC_INLINE, remote::FUNC_READ_ONLY);
 
     fm.add("kedixa/add", +[](int a, int b) {
         std::cout << "kedixa/add: " << a << " " << b << std::endl;
         return a + b;
-    });
+    }, remote::EXEC_INLINE, remote::FUNC_READ_ONLY);
 
     fm.add("kedixa/to_string", +[](int x) {
         std::cout << "kedixa/to_string: " << x << std::endl;
         return std::to_string(x);
-    });
+    }, remote::EXEC_INLINE, remote::FUNC_READ_ONLY);
 
     fm.add("kedixa/append", +[](std::string &str, const std::string &append) {
         std::cout << "kedixa/append: " << std::quoted(str) << ' '
                   << std::quoted(append) << std::endl;
         str.append(append);
-    });
+    }, remote::EXEC_INLINE, remote::FUNC_READ_ONLY);
 
     fm.add("kedixa/next_id", +[]() {
         std::size_t x = id.fetch_add(1, std::memory_order_relaxed);
@@ -103,22 +259,82 @@ void register_functions() {
     fm.add("kedixa/integer_less", +[](long long a, long long b) {
         std::cout << "kedixa/integer_less: " << a << ' ' << b << std::endl;
         return a < b;
-    });
+    }, remote::EXEC_INLINE, remote::FUNC_READ_ONLY);
+}
+
+// Usage: server [port [name [target=host:port ...]]]
+bool register_servers(int argc, char *argv[]) {
+    if (argc > 2)
+        fm.set_name(argv[2]);
+
+    for (int i = 3; i < argc; i++) {
+        std::string str(argv[i]);
+        auto eq = str.find('=');
+        auto colon = str.rfind(':');
+
+        if (eq == std::string::npos || colon == std::string::npos ||
+            colon < eq) {
+            std::cerr << "Invalid target " << std::quoted(str) << std::endl;
+            return false;
+        }
+
+        remote::ClientParams params;
+        params.host = str.substr(eq + 1, colon - eq - 1);
+        params.port = std::atoi(str.c_str() + colon + 1);
+        fm.add_server(str.substr(0, eq), params);
+    }
+
+    return true;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     signal(SIGTERM, sighandler);
     signal(SIGINT, sighandler);
 
+    int port = argc > 1 ? std::atoi(argv[1]) : 5300;
+
     register_functions();
+    if (!register_servers(argc, argv))
+        return 1;
+
+    // Share one execution among identical read only requests in flight.
+    coalesce = std::getenv("REMOTE_SINGLEFLIGHT") != nullptr;
+
+    // Persist the kv store when REMOTE_KV_DIR is set.
+    const char *kv_dir = std::getenv("REMOTE_KV_DIR");
+    if (kv_dir) {
+        if (!kv.open(kv_dir)) {
+            std::cerr << "Open kv store failed" << std::endl;
+            return 1;
+        }
+
+        kv.start_compaction(std::chrono::seconds(60));
+    }
 
-    remote::Server server(process);
+    // Listen REMOTE_LISTENERS times on the port, and pin the handler threads
+    // to the cpus of REMOTE_NUMA_NODE when it is set.
+    remote::ListenerParams lparams;
+    const char *listeners = std::getenv("REMOTE_LISTENERS");
+    const char *numa_node = std::getenv("REMOTE_NUMA_NODE");
 
-    if (server.start(5300) == 0) {
+    if (listeners)
+        lparams.listeners = std::atoi(listeners);
+
+    if (numa_node)
+        lparams.cpus = remote::numa_node_cpus(std::atoi(numa_node));
+
+    remote::ServerGroup server(process, lparams);
+
+    if (server.start(port) == 0) {
         std::cout << "Server started" << std::endl;
         run_flag.wait(true, std::memory_order_relaxed);
         server.shutdown();
         server.wait_finish();
+
+        // Keep the spans of sampled requests when REMOTE_TRACE_FILE is set.
+        const char *trace_file = std::getenv("REMOTE_TRACE_FILE");
+        if (trace_file)
+            remote::Tracer::instance().dump(trace_file);
     }
     else {
         std::cerr << "Server start failed" << std::endl;
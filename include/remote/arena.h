@@ -0,0 +1,54 @@
+#ifndef REMOTE_ARENA_H
+#define REMOTE_ARENA_H
+
+#include <cstddef>
+#include <memory_resource>
+
+namespace remote {
+
+/**
+ * Monotonic memory resource for the lifetime of one request. Memory is only
+ * given back when the arena is destroyed, blocks of BLOCK_SIZE are then kept
+ * in a thread local cache and reused by the next arena on that thread, so a
+ * typical request allocates nothing from the global heap.
+ */
+class Arena : public std::pmr::memory_resource {
+public:
+    static constexpr std::size_t BLOCK_SIZE = 16 * 1024;
+    static constexpr std::size_t MAX_CACHED_BLOCKS = 64;
+
+    Arena() = default;
+    ~Arena() { release(); }
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    void release();
+
+private:
+    struct Block {
+        Block *next;
+    };
+
+    void *do_allocate(std::size_t bytes, std::size_t align) override;
+
+    void do_deallocate(void *, std::size_t, std::size_t) override { }
+
+    bool do_is_equal(const std::pmr::memory_resource &other)
+        const noexcept override
+    {
+        return this == &other;
+    }
+
+    void *allocate_large(std::size_t bytes, std::size_t align);
+
+private:
+    Block *blocks{nullptr};
+    Block *large_blocks{nullptr};
+    char *cur{nullptr};
+    char *end{nullptr};
+};
+
+} // namespace remote
+
+#endif // REMOTE_ARENA_H
@@ -1,6 +1,12 @@
 #ifndef REMOTE_CLIENT_H
 #define REMOTE_CLIENT_H
 
+#include <cstdint>
+#include <deque>
+#include <span>
+#include <string>
+#include <utility>
+
 #include "remote/command_builder.h"
 #include "coke/task.h"
 
@@ -13,6 +19,60 @@ struct ClientParams {
     int send_timeout        = -1;
     int receive_timeout     = -1;
     int keep_alive_timeout  = 60 * 1000;
+
+    // Time budget of a call in milliseconds, -1 means no limit. Servers pass
+    // what remains of it on to the downstream servers they forward to.
+    int call_timeout        = -1;
+};
+
+// Error of a request which failed on the server, with the state
+// WFT_STATE_TASK_ERROR. The message is kept by the CommandBuilder or Stream.
+constexpr int REMOTE_ERR_SERVER = 1;
+
+class Client;
+
+/**
+ * Chunks emitted by a program opened with Client::open_stream. They are
+ * fetched from the server in batches as next() consumes them. Once the
+ * stream ends without error, the return values are available through the
+ * CommandBuilder of the program.
+ */
+class Stream {
+public:
+    Stream() = default;
+
+    // Move to the next chunk, false at the end of the stream, on error or
+    // on network failure.
+    coke::Task<bool> next();
+
+    // Value of the current chunk, views refer to the chunk and stay valid
+    // until next() is called.
+    template<typename T>
+    T get() const {
+        std::size_t off = 0;
+        bool referenced;
+        auto handle = msgpack::unpack(current.data(), current.size(), off,
+                                      referenced, unpack_reference);
+        return handle.get().as<T>();
+    }
+
+    // Stop the program on the server before it is finished.
+    coke::Task<void> close();
+
+    std::pair<int,int> get_status() const { return status; }
+    const std::string &get_error() const { return error; }
+
+private:
+    Client *client{nullptr};
+    CommandBuilder *builder{nullptr};
+    uint64_t id{0};
+    bool done{true};
+    std::pair<int,int> status{0, 0};
+    std::string error;
+    std::string current;
+    std::deque<std::string> chunks;
+
+    friend class Client;
 };
 
 class Client {
@@ -21,10 +81,29 @@ public:
         : params(params)
     { }
 
-    coke::Task<std::pair<int,int>> call(CommandBuilder &b);
+    coke::Task<std::pair<int,int>>
+    call(CommandBuilder &b, TraceContext trace = TraceContext());
+
+    // The error message of REMOTE_ERR_SERVER is stored to `error` if given.
+    coke::Task<std::pair<int,int>>
+    call(const DataMap &data, std::span<const Command> cmds,
+         std::span<const ArgID> return_ids, CallMeta meta,
+         DataMap &return_data, std::string *error = nullptr);
+
+    // Start the program of `b` on the server, and receive the values it
+    // emits through `s`.
+    coke::Task<std::pair<int,int>> open_stream(CommandBuilder &b, Stream &s);
+
+private:
+    // Send a message of `type`, timeouts are limited to `budget` unless it
+    // is negative. On REMOTE_ERR_SERVER `reply` is the error message.
+    coke::Task<std::pair<int,int>>
+    request(int type, std::string msg, int budget, std::string &reply);
 
 private:
     ClientParams params;
+
+    friend Stream;
 };
 
 } // namespace remote
@@ -4,7 +4,11 @@
 #include <cctype>
 #include <cstdint>
 #include <map>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
 #include "remote/common.h"
@@ -74,7 +78,7 @@ public:
 
     template<typename U>
     Arg arg(U &&u) {
-        std::string str;
+        std::pmr::string str;
         PackStream stream(str);
         ArgID id = next_id();
 
@@ -86,6 +90,14 @@ public:
 
     template<typename... Args>
     ArgWrapper remote(const std::string &name, Args &&... args) {
+        return remote_at(std::string(), name, std::forward<Args>(args)...);
+    }
+
+    // Invoke `name` on the downstream server `target`, which must be
+    // registered on the executing server by FunctionManager::add_server.
+    template<typename... Args>
+    ArgWrapper remote_at(const std::string &target, const std::string &name,
+                         Args &&... args) {
         Command cmd;
 
         auto handle_args = [this, &cmd] <typename U> (U &&u) {
@@ -106,6 +118,7 @@ public:
         cmd.type = CMD_INVOKE;
         cmd.ret_id = INDETERMINATE_ID;
         cmd.name = name;
+        cmd.target = target;
         cmds.push_back(std::move(cmd));
 
         return ArgWrapper(this, cmds.size() - 1);
@@ -156,6 +169,15 @@ public:
         cmds[label_start].label = cmds.size();
     }
 
+    // Send the current value of `arg` to the client as a stream chunk, only
+    // meaningful when the program is run by Client::open_stream.
+    void remote_emit(const Arg &arg) {
+        Command cmd;
+        cmd.type = CMD_EMIT;
+        cmd.arg_ids.push_back(arg.get_id());
+        cmds.push_back(std::move(cmd));
+    }
+
     void remote_return() {
         Command cmd;
         cmd.type = CMD_RETURN;
@@ -176,15 +198,28 @@ public:
         return get_return_value<T>(arg.get_id());
     }
 
+    // std::string_view and std::span<const char> results refer to the
+    // response buffer, and stay valid until the builder is called again.
     template<typename T>
     T get_return_value(ArgID id) {
-        auto it = return_data.find(id);
-        if (it == return_data.end())
-            throw std::runtime_error("arg not found");
+        const msgpack::object &obj = get_return_object(id);
 
-        const std::string &str = it->second;
-        auto handle = msgpack::unpack(str.data(), str.size());
-        return handle.get().as<T>();
+        if constexpr (std::is_same_v<T, std::span<const char>>) {
+            if (obj.type == msgpack::type::BIN)
+                return T(obj.via.bin.ptr, obj.via.bin.size);
+            else if (obj.type == msgpack::type::STR)
+                return T(obj.via.str.ptr, obj.via.str.size);
+            else
+                throw msgpack::type_error();
+        }
+        else {
+            return obj.as<T>();
+        }
+    }
+
+    // Error message of the last call if its program failed on the server.
+    const std::string &get_error() const {
+        return error;
     }
 
 private:
@@ -196,15 +231,67 @@ private:
         cmds[cmd_id].ret_id = ret_id;
     }
 
+    // Keep the response and index the packed value of each returned arg,
+    // values are decoded only when they are first accessed.
+    void set_response(std::string &&resp) {
+        return_cache.clear();
+        return_index.clear();
+        error.clear();
+        response = std::move(resp);
+
+        std::size_t off = 0;
+        bool referenced;
+        auto handle = msgpack::unpack(response.data(), response.size(), off,
+                                      referenced, unpack_reference);
+        const msgpack::object &obj = handle.get();
+
+        if (obj.type != msgpack::type::MAP)
+            throw msgpack::type_error();
+
+        for (uint32_t i = 0; i < obj.via.map.size; i++) {
+            const msgpack::object_kv &kv = obj.via.map.ptr[i];
+
+            if (kv.val.type != msgpack::type::STR)
+                throw msgpack::type_error();
+
+            std::string_view value(kv.val.via.str.ptr, kv.val.via.str.size);
+            return_index[kv.key.as<ArgID>()] = value;
+        }
+    }
+
+    const msgpack::object &get_return_object(ArgID id) {
+        auto it = return_cache.find(id);
+        if (it != return_cache.end())
+            return it->second.get();
+
+        auto iit = return_index.find(id);
+        if (iit == return_index.end())
+            throw std::runtime_error("arg not found");
+
+        std::string_view str = iit->second;
+        std::size_t off = 0;
+        bool referenced;
+        auto handle = msgpack::unpack(str.data(), str.size(), off, referenced,
+                                      unpack_reference);
+
+        it = return_cache.emplace(id, std::move(handle)).first;
+        return it->second.get();
+    }
+
 private:
-    std::map<ArgID, std::string> data;
-    std::map<ArgID, std::string> return_data;
+    DataMap data;
     std::vector<Command> cmds;
     std::vector<ArgID> return_ids;
     ArgID cur_id{FIRST_ID};
 
+    std::string response;
+    std::string error;
+    std::map<ArgID, std::string_view> return_index;
+    std::map<ArgID, msgpack::object_handle> return_cache;
+
     friend Arg;
     friend class Client;
+    friend class Stream;
 };
 
 inline Arg::Arg(ArgWrapper &&w) noexcept {
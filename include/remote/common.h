@@ -1,7 +1,10 @@
 #ifndef REMOTE_COMMON_H
 #define REMOTE_COMMON_H
 
+#include <chrono>
 #include <cstdint>
+#include <map>
+#include <memory_resource>
 #include <string>
 #include <vector>
 
@@ -15,6 +18,24 @@ enum : uint32_t {
     CMD_JUMP = 2,
     CMD_JUMP_TRUE = 3,
     CMD_JUMP_FALSE = 4,
+    CMD_EMIT = 5,
+};
+
+// Type of TLV messages.
+enum : int {
+    MSG_CALL = 0,
+    MSG_STREAM_OPEN = 1,
+    MSG_STREAM_NEXT = 2,
+    MSG_STREAM_CLOSE = 3,
+
+    // Type of the reply to a request which failed on the server, its value
+    // is the error message.
+    MSG_ERROR = 4,
+
+    // Set in the type of requests which are sampled for tracing, so that
+    // the server knows it before decoding the request.
+    MSG_FLAG_SAMPLED = 1 << 16,
+    MSG_TYPE_MASK = MSG_FLAG_SAMPLED - 1,
 };
 
 using ArgID = uint32_t;
@@ -22,25 +43,171 @@ using ArgID = uint32_t;
 constexpr ArgID INDETERMINATE_ID = 0;
 constexpr ArgID FIRST_ID = 1;
 
+// A forwarded program may pass through at most this many servers.
+constexpr uint32_t MAX_FORWARD_HOPS = 8;
+
+// Commands are allocator aware, so that a program decoded by the server can
+// live entirely in the per request arena.
 struct Command {
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    Command() = default;
+    Command(const Command &) = default;
+    Command(Command &&) = default;
+
+    explicit Command(const allocator_type &alloc)
+        : name(alloc), arg_ids(alloc), target(alloc)
+    { }
+
+    Command(const Command &other, const allocator_type &alloc)
+        : type(other.type), ret_id(other.ret_id), label(other.label),
+          name(other.name, alloc), arg_ids(other.arg_ids, alloc),
+          target(other.target, alloc)
+    { }
+
+    Command(Command &&other, const allocator_type &alloc)
+        : type(other.type), ret_id(other.ret_id), label(other.label),
+          name(std::move(other.name), alloc),
+          arg_ids(std::move(other.arg_ids), alloc),
+          target(std::move(other.target), alloc)
+    { }
+
+    Command &operator=(const Command &) = default;
+    Command &operator=(Command &&) = default;
+
     uint32_t type{0};
     ArgID ret_id{INDETERMINATE_ID};
     std::size_t label{(std::size_t)-1};
-    std::string name;
-    std::vector<ArgID> arg_ids;
+    std::pmr::string name;
+    std::pmr::vector<ArgID> arg_ids;
+
+    // Name of the downstream server which executes this command, empty
+    // means execute on the server that receives the program.
+    std::pmr::string target;
+
+    MSGPACK_DEFINE(type, ret_id, label, name, arg_ids, target);
+};
+
+struct CallMeta {
+    // Number of servers the program has been forwarded through.
+    uint32_t hops{0};
+
+    // Remaining time budget in milliseconds, -1 means no limit.
+    int timeout{-1};
+
+    // Names of the servers the program has been forwarded through.
+    std::vector<std::string> path;
+
+    uint64_t trace_id{0};
+    bool sampled{false};
+
+    // When the request was received, the budget is counted from here. It is
+    // local to each server and not sent.
+    std::chrono::steady_clock::time_point received{
+        std::chrono::steady_clock::now()
+    };
+
+    MSGPACK_DEFINE(hops, timeout, path, trace_id, sampled);
+};
+
+struct TraceContext {
+    uint64_t trace_id{0};
 
-    MSGPACK_DEFINE(type, ret_id, label, name, arg_ids);
+    // Record spans of this request on the servers it passes through.
+    bool sampled{false};
 };
 
+// Packed values of each arg, keyed by arg id.
+using DataMap = std::pmr::map<ArgID, std::pmr::string>;
+
+template<typename String = std::string>
 struct PackStream {
     PackStream &write(const char *buf, size_t len) {
         data.append(buf, len);
         return *this;
     }
 
-    std::string &data;
+    String &data;
 };
 
+template<typename String>
+PackStream(String &) -> PackStream<String>;
+
+// Reference func for msgpack::unpack, which makes str and bin objects refer
+// to the input buffer instead of copying them into the zone.
+inline bool unpack_reference(msgpack::type::object_type, std::size_t, void *) {
+    return true;
+}
+
 } // namespace remote
 
+namespace msgpack {
+MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) {
+namespace adaptor {
+
+template<>
+struct convert<std::pmr::string> {
+    const msgpack::object &operator()(const msgpack::object &o,
+                                      std::pmr::string &v) const {
+        switch (o.type) {
+        case msgpack::type::BIN:
+            v.assign(o.via.bin.ptr, o.via.bin.size);
+            break;
+
+        case msgpack::type::STR:
+            v.assign(o.via.str.ptr, o.via.str.size);
+            break;
+
+        default:
+            throw msgpack::type_error();
+        }
+
+        return o;
+    }
+};
+
+template<>
+struct pack<std::pmr::string> {
+    template<typename Stream>
+    msgpack::packer<Stream> &operator()(msgpack::packer<Stream> &o,
+                                        const std::pmr::string &v) const {
+        uint32_t size = checked_get_container_size(v.size());
+        o.pack_str(size);
+        o.pack_str_body(v.data(), size);
+        return o;
+    }
+};
+
+// Build the nodes with the allocator of the target map, the generic map
+// adaptor converts into a temporary map with the default resource.
+template<typename K, typename V, typename Compare>
+struct convert<std::map<K, V, Compare,
+                        std::pmr::polymorphic_allocator<std::pair<const K, V>>>> {
+    using Map = std::map<K, V, Compare,
+                         std::pmr::polymorphic_allocator<std::pair<const K, V>>>;
+
+    const msgpack::object &operator()(const msgpack::object &o,
+                                      Map &v) const {
+        if (o.type != msgpack::type::MAP)
+            throw msgpack::type_error();
+
+        v.clear();
+
+        msgpack::object_kv *p = o.via.map.ptr;
+        msgpack::object_kv *const pend = o.via.map.ptr + o.via.map.size;
+
+        for (; p != pend; ++p) {
+            K key = p->key.as<K>();
+            auto it = v.try_emplace(v.end(), std::move(key));
+            p->val.convert(it->second);
+        }
+
+        return o;
+    }
+};
+
+} // namespace adaptor
+} // MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS)
+} // namespace msgpack
+
 #endif // REMOTE_COMMON_H
@@ -2,14 +2,24 @@
 #define REMOTE_FUNCTION_MANAGER_H
 
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string_view>
 #include <tuple>
 #include <type_traits>
 #include <unordered_map>
 
+#include "remote/client.h"
 #include "remote/common.h"
+#include "remote/trace.h"
+#include "coke/task.h"
 
 namespace remote {
 
@@ -20,22 +30,62 @@ template<typename T>
 constexpr bool is_non_const_lvalue_ref_v = std::is_lvalue_reference_v<T> &&
                                 !std::is_const_v<std::remove_reference_t<T>>;
 
+// Where a registered function runs. EXEC_COMPUTE functions run on the
+// compute threads of workflow, EXEC_BLOCKING functions on a fixed pool of
+// threads of their own, so that blocking ones never hold the compute threads.
+// After a pooled function the program goes back to a network handler thread.
+enum ExecClass : int {
+    EXEC_INLINE = 0,
+    EXEC_COMPUTE = 1,
+    EXEC_BLOCKING = 2,
+    EXEC_CLASS_MAX = 3,
+};
+
+// Attributes of a registered function.
+enum : unsigned {
+    // The function has no side effects outside of its args, so identical
+    // programs made of such functions may share one execution.
+    FUNC_READ_ONLY = 1,
+};
+
+struct ExecStat {
+    std::size_t queued;
+    std::size_t running;
+    std::size_t finished;
+    std::size_t rejected;
+};
 
 class FunctionManager {
 public:
-    using DataMap = std::map<ArgID, std::string>;
-    using ArgList = std::vector<ArgID>;
-    using Function = std::function<std::string(DataMap &data, const ArgList &args)>;
+    using DataMap = remote::DataMap;
+    using ArgList = std::span<const ArgID>;
+    using Function = std::function<std::pmr::string(DataMap &data, ArgList args)>;
+
+    // Receives the values emitted by CMD_EMIT, returns false to stop the
+    // program.
+    using ChunkSink = std::function<coke::Task<bool>(const std::pmr::string &)>;
 
 private:
+    // Unpack into a zone reused by every call on this thread, str and bin
+    // objects refer to `str` so string_view parameters are not copied.
+    static msgpack::object unpack_ref(std::string_view str) {
+        thread_local msgpack::zone zone;
+        std::size_t off = 0;
+        bool referenced;
+
+        zone.clear();
+        return msgpack::unpack(zone, str.data(), str.size(), off, referenced,
+                               unpack_reference);
+    }
+
     template<size_t... I, typename... Args>
     static void parse_to_tuple(std::tuple<Args...> &tp,
-                               const std::vector<std::string_view> &args,
+                               const std::array<std::string_view,
+                                                sizeof...(I)> &args,
                                std::index_sequence<I...>)
     {
         auto parse = [&] <typename U> (U &arg, std::string_view str) {
-            auto handle = msgpack::unpack(str.data(), str.size());
-            handle.get().convert(arg);
+            unpack_ref(str).convert(arg);
         };
 
         (parse(std::get<I>(tp), args[I]), ...);
@@ -44,11 +94,11 @@ private:
     template<size_t... I, typename... Args>
     static void save_ref(std::tuple<Args...> &tp, DataMap &data,
                          const std::array<bool, sizeof...(I)> &is_ref,
-                         const ArgList &arg_list, std::index_sequence<I...>)
+                         ArgList arg_list, std::index_sequence<I...>)
     {
         auto save = [&] <typename U> (const U &arg, std::size_t i) {
             if (is_ref[i]) {
-                std::string str;
+                std::pmr::string str(data.get_allocator());
                 PackStream stream(str);
                 msgpack::pack(stream, arg);
                 data[arg_list[i]] = std::move(str);
@@ -60,8 +110,8 @@ private:
 
 
     template<typename R, typename... Args>
-    static std::string call_func(const std::function<R(Args...)> &func,
-                                 DataMap &data, const ArgList &arg_list)
+    static std::pmr::string call_func(const std::function<R(Args...)> &func,
+                                      DataMap &data, ArgList arg_list)
     {
         using Tuple = remove_cvref_tuple_t<Args...>;
 
@@ -71,12 +121,15 @@ private:
             is_non_const_lvalue_ref_v<Args>...
         };
 
-        std::vector<std::string_view> args;
-        std::string result_str;
+        std::array<std::string_view, arg_size> args;
+        std::pmr::string result_str(data.get_allocator());
         Tuple tp{};
 
-        for (auto id : arg_list)
-            args.push_back(data[id]);
+        if (arg_list.size() != arg_size)
+            throw std::runtime_error("argument count mismatch");
+
+        for (std::size_t i = 0; i < arg_size; i++)
+            args[i] = data[arg_list[i]];
 
         if constexpr (arg_size > 0)
             parse_to_tuple(tp, args, index_seq);
@@ -96,88 +149,164 @@ private:
         return result_str;
     }
 
-    bool test(const std::string &value) {
-        auto handle = msgpack::unpack(value.data(), value.size());
-        return handle.get().as<bool>();
+    bool test(std::string_view value) {
+        return unpack_ref(value).as<bool>();
     }
 
 public:
-    FunctionManager() = default;
+    // The reserved function "remote/trace" returns the spans of a trace
+    // recorded on this server, see Tracer.
+    FunctionManager();
+    ~FunctionManager();
 
+    // Register `func` as `name`, see ExecClass for where it runs.
     template<typename R, typename... Args>
-    bool add(const std::string &name, std::function<R(Args...)> func) {
-        Function proc_func = [func](DataMap &data, const ArgList &args) {
+    bool add(const std::string &name, std::function<R(Args...)> func,
+             ExecClass cls = EXEC_INLINE, unsigned attrs = 0) {
+        Function proc_func = [func](DataMap &data, ArgList args) {
             return call_func(func, data, args);
         };
 
-        return func_map.try_emplace(name, std::move(proc_func)).second;
+        FunctionEntry entry{std::move(proc_func), cls, attrs};
+        return func_map.try_emplace(name, std::move(entry)).second;
     }
 
     template<typename R, typename... Args>
-    bool add(const std::string &name, R(*func)(Args...)) {
-        return add(name, std::function<R(Args...)>(func));
+    bool add(const std::string &name, R(*func)(Args...),
+             ExecClass cls = EXEC_INLINE, unsigned attrs = 0) {
+        return add(name, std::function<R(Args...)>(func), cls, attrs);
     }
 
     bool erase(const std::string &name) {
         return func_map.erase(name) == 1;
     }
 
-    void invoke(DataMap &data, const std::vector<Command> &cmds) {
-        std::size_t x = 0;
-        std::size_t instructions = 0;
-        std::size_t max_instructions = 100;
+    // Register a downstream server which commands built by
+    // CommandBuilder::remote_at may target.
+    bool add_server(const std::string &name, const ClientParams &params) {
+        return servers.try_emplace(name, params).second;
+    }
 
-        while (instructions < max_instructions) {
-            ++instructions;
+    bool erase_server(const std::string &name) {
+        return servers.erase(name) == 1;
+    }
 
-            if (x >= cmds.size())
-                break;
+    // Name of this server, used to detect forwarding loops.
+    void set_name(const std::string &name) {
+        server_name = name;
+    }
 
-            const Command &cmd = cmds[x];
+    const std::string &get_name() const {
+        return server_name;
+    }
 
-            switch (cmd.type) {
-            case CMD_INVOKE:
-            {
-                auto it = func_map.find(cmd.name);
-                if (it == func_map.end())
-                    throw std::runtime_error("function not found");
+    // Functions of a pooled class which are queued or running at the same
+    // time are limited to `limit`, calls beyond that are rejected.
+    void set_queue_limit(ExecClass cls, std::size_t limit) {
+        exec_queues[cls].limit = limit;
+    }
 
-                std::string s = (it->second)(data, cmd.arg_ids);
-                data[cmd.ret_id] = std::move(s);
-                ++x;
-                break;
-            }
+    // Maximum number of instructions a program may run, programs of streams
+    // have a limit of their own as they may scan large data. A program over
+    // the limit fails. Programs of streams give up the handler thread every
+    // STREAM_SLICE instructions, so a long scan does not hold it.
+    void set_instruction_limit(std::size_t call, std::size_t stream) {
+        max_instructions = call;
+        max_stream_instructions = stream;
+    }
 
-            case CMD_RETURN:
-                break;
-
-            case CMD_JUMP:
-                x = cmd.label;
-                break;
-
-            case CMD_JUMP_TRUE:
-                if (test(data[cmd.arg_ids[0]]))
-                    x = cmd.label;
-                else
-                    ++x;
-                break;
-
-            case CMD_JUMP_FALSE:
-                if (test(data[cmd.arg_ids[0]]))
-                    ++x;
-                else
-                    x = cmd.label;
-                break;
-
-            default:
-                //break;
-                throw std::runtime_error("unknown command type");
-            }
+    // Number of threads running EXEC_BLOCKING functions, takes effect only
+    // before the first of them is called.
+    void set_blocking_threads(std::size_t n) {
+        blocking_threads = n;
+    }
+
+    ExecStat get_exec_stat(ExecClass cls) const {
+        const ExecQueue &q = exec_queues[cls];
+
+        return ExecStat{
+            .queued     = q.queued.load(std::memory_order_relaxed),
+            .running    = q.running.load(std::memory_order_relaxed),
+            .finished   = q.finished.load(std::memory_order_relaxed),
+            .rejected   = q.rejected.load(std::memory_order_relaxed),
+        };
+    }
+
+    // Whether every function invoked by `cmds` is registered with
+    // FUNC_READ_ONLY. Forwarded commands are never considered read only.
+    bool is_read_only(std::span<const Command> cmds) const {
+        for (const Command &cmd : cmds) {
+            if (cmd.type != CMD_INVOKE)
+                continue;
+
+            if (!cmd.target.empty())
+                return false;
+
+            auto it = func_map.find(std::string_view(cmd.name));
+            if (it == func_map.end() || !(it->second.attrs & FUNC_READ_ONLY))
+                return false;
         }
+
+        return true;
     }
 
+    coke::Task<void> invoke(DataMap &data, std::span<const Command> cmds,
+                            CallMeta meta = CallMeta(),
+                            ChunkSink sink = nullptr);
+
 private:
-    std::unordered_map<std::string, Function> func_map;
+    struct FunctionEntry {
+        Function func;
+        ExecClass cls;
+        unsigned attrs;
+    };
+
+    struct ExecQueue {
+        const char *name;
+        std::size_t limit{4096};
+
+        // Queued and running calls, a call reserves its slot here first.
+        std::atomic<std::size_t> pending{0};
+        std::atomic<std::size_t> queued{0};
+        std::atomic<std::size_t> running{0};
+        std::atomic<std::size_t> finished{0};
+        std::atomic<std::size_t> rejected{0};
+    };
+
+    struct BlockingPool;
+
+    coke::Task<void> call_in_pool(const FunctionEntry &entry, DataMap &data,
+                                  const Command &cmd);
+    BlockingPool *get_blocking_pool();
+
+    coke::Task<std::size_t> forward(DataMap &data,
+                                    std::span<const Command> cmds,
+                                    std::size_t pos, const CallMeta &meta);
+
+    struct NameHash {
+        using is_transparent = void;
+
+        std::size_t operator()(std::string_view name) const {
+            return std::hash<std::string_view>{}(name);
+        }
+    };
+
+    std::unordered_map<std::string, FunctionEntry, NameHash,
+                       std::equal_to<>> func_map;
+    std::array<ExecQueue, EXEC_CLASS_MAX> exec_queues{{
+        {"remote.inline"}, {"remote.compute"}, {"remote.blocking"},
+    }};
+    static constexpr std::size_t STREAM_SLICE = 4096;
+
+    std::size_t max_instructions{100};
+    std::size_t max_stream_instructions{16 * 1024 * 1024};
+
+    std::size_t blocking_threads{16};
+    std::once_flag blocking_once;
+    std::unique_ptr<BlockingPool> blocking_pool;
+
+    std::unordered_map<std::string, Client, NameHash, std::equal_to<>> servers;
+    std::string server_name;
 };
 
 } // namespace remote
@@ -1,6 +1,12 @@
 #ifndef REMOTE_SERVER_H
 #define REMOTE_SERVER_H
 
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "coke/net/basic_server.h"
 #include "remote/task.h"
 
@@ -37,6 +43,79 @@ public:
     { }
 };
 
+struct ListenerParams {
+    // Number of listeners bound to the same port by SO_REUSEPORT.
+    int listeners           = 1;
+
+    // Handler threads are pinned to these cpus one by one when they first
+    // process a request, empty means no pinning. Handler threads are shared
+    // by the whole process, so a thread is pinned only once, by the first
+    // group which runs a request on it.
+    std::vector<int> cpus;
+};
+
+struct ListenerStat {
+    std::size_t requests;
+    std::size_t active;
+    std::size_t connections;
+};
+
+// Cpus of a NUMA node, empty if the node is not found.
+std::vector<int> numa_node_cpus(int node);
+
+/**
+ * A group of servers listening on the same port, the kernel distributes
+ * incoming connections among them, so accepting does not go through a single
+ * listen socket.
+ */
+class ServerGroup {
+    using ProcessorType = Server::ProcessorType;
+
+public:
+    ServerGroup(const RemoteServerParams &params, ProcessorType co_proc,
+                const ListenerParams &lparams);
+
+    ServerGroup(ProcessorType co_proc, const ListenerParams &lparams)
+        : ServerGroup(RemoteServerParams(), std::move(co_proc), lparams)
+    { }
+
+    ~ServerGroup() = default;
+
+    ServerGroup(const ServerGroup &) = delete;
+    ServerGroup &operator=(const ServerGroup &) = delete;
+
+    int start(int port) {
+        return start(std::string(), port);
+    }
+
+    int start(const std::string &host, int port);
+
+    void shutdown();
+    void wait_finish();
+
+    std::vector<ListenerStat> get_stats() const;
+
+private:
+    struct Listener {
+        Listener(ServerGroup *group, const RemoteServerParams &params);
+
+        Server server;
+        std::atomic<std::size_t> requests{0};
+        std::atomic<std::size_t> active{0};
+    };
+
+    coke::Task<> process(Listener *l, RemoteServerContext ctx);
+
+    void pin_thread();
+
+private:
+    ProcessorType co_proc;
+    std::vector<int> cpus;
+    std::atomic<std::size_t> pinned_threads{0};
+    std::vector<std::unique_ptr<Listener>> listeners;
+    std::size_t started{0};
+};
+
 } // namespace remote
 
 #endif //REMOTE_SERVER_H
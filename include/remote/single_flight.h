@@ -0,0 +1,120 @@
+#ifndef REMOTE_SINGLE_FLIGHT_H
+#define REMOTE_SINGLE_FLIGHT_H
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "coke/latch.h"
+#include "coke/task.h"
+
+namespace remote {
+
+struct SingleFlightStat {
+    std::size_t executed;
+    std::size_t coalesced;
+};
+
+/**
+ * Coalesce identical requests in flight. The first request with a key runs,
+ * the ones arriving before it finishes wait and share its response. Only
+ * requests without side effects may be coalesced.
+ */
+class SingleFlight {
+    struct Flight {
+        coke::Latch latch{1};
+        std::string response;
+        std::exception_ptr eptr;
+    };
+
+    struct KeyHash {
+        using is_transparent = void;
+
+        std::size_t operator()(std::string_view key) const {
+            return std::hash<std::string_view>{}(key);
+        }
+    };
+
+public:
+    using Producer = std::function<coke::Task<std::string>()>;
+
+    SingleFlight() = default;
+    ~SingleFlight() = default;
+
+    SingleFlight(const SingleFlight &) = delete;
+    SingleFlight &operator=(const SingleFlight &) = delete;
+
+    coke::Task<std::string> run(std::string_view key, Producer producer) {
+        std::shared_ptr<Flight> flight;
+        bool leader = false;
+
+        {
+            std::lock_guard<std::mutex> lg(mtx);
+            auto it = flights.find(key);
+
+            if (it == flights.end()) {
+                flight = std::make_shared<Flight>();
+                flights.emplace(std::string(key), flight);
+                leader = true;
+            }
+            else
+                flight = it->second;
+        }
+
+        if (!leader) {
+            coalesced.fetch_add(1, std::memory_order_relaxed);
+            co_await flight->latch.wait();
+
+            if (flight->eptr)
+                std::rethrow_exception(flight->eptr);
+
+            co_return flight->response;
+        }
+
+        executed.fetch_add(1, std::memory_order_relaxed);
+
+        try {
+            flight->response = co_await producer();
+        }
+        catch (...) {
+            flight->eptr = std::current_exception();
+        }
+
+        {
+            std::lock_guard<std::mutex> lg(mtx);
+            flights.erase(flights.find(key));
+        }
+
+        flight->latch.count_down();
+
+        if (flight->eptr)
+            std::rethrow_exception(flight->eptr);
+
+        co_return flight->response;
+    }
+
+    SingleFlightStat get_stat() const {
+        return SingleFlightStat{
+            .executed   = executed.load(std::memory_order_relaxed),
+            .coalesced  = coalesced.load(std::memory_order_relaxed),
+        };
+    }
+
+private:
+    std::mutex mtx;
+    std::unordered_map<std::string, std::shared_ptr<Flight>, KeyHash,
+                       std::equal_to<>> flights;
+
+    std::atomic<std::size_t> executed{0};
+    std::atomic<std::size_t> coalesced{0};
+};
+
+} // namespace remote
+
+#endif // REMOTE_SINGLE_FLIGHT_H
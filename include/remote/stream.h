@@ -0,0 +1,125 @@
+#ifndef REMOTE_STREAM_H
+#define REMOTE_STREAM_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "remote/common.h"
+#include "coke/latch.h"
+#include "coke/task.h"
+
+namespace remote {
+
+/**
+ * Server side state of a program opened by Client::open_stream. The program
+ * runs detached from the request which opened it, chunks emitted by it are
+ * queued here until the client pulls them with MSG_STREAM_NEXT, and the
+ * program is suspended while MAX_QUEUED_BYTES are waiting. Its data lives in
+ * a pool rather than an Arena, as a long program keeps replacing its values.
+ */
+class StreamSession {
+public:
+    static constexpr std::size_t MAX_QUEUED_BYTES = 1024 * 1024;
+    static constexpr std::size_t MAX_BATCH_BYTES = 256 * 1024;
+
+    StreamSession()
+        : data(&pool), cmds(&pool), return_ids(&pool)
+    { }
+
+    StreamSession(const StreamSession &) = delete;
+    StreamSession &operator=(const StreamSession &) = delete;
+
+    // Queue a chunk, returns false if the session is closed.
+    coke::Task<bool> push(std::string chunk);
+
+    // The program finished with packed return values or an error.
+    void finish(std::string result, std::string error);
+
+    // Wait for chunks or the end of the program, and pack them as the reply
+    // of MSG_STREAM_NEXT. `done` is set if nothing is left after the reply.
+    // A pull while another one is waiting closes the session, and is
+    // answered with an error.
+    coke::Task<std::string> pull(bool &done);
+
+    void close();
+
+    bool idle_for(std::chrono::steady_clock::duration d);
+
+public:
+    std::pmr::unsynchronized_pool_resource pool;
+    DataMap data;
+    std::pmr::vector<Command> cmds;
+    std::pmr::vector<ArgID> return_ids;
+    CallMeta meta;
+
+private:
+    using Signal = std::shared_ptr<coke::Latch>;
+
+    static void wake(Signal &signal) {
+        if (signal) {
+            signal->count_down();
+            signal.reset();
+        }
+    }
+
+private:
+    std::mutex mtx;
+    std::deque<std::string> chunks;
+    std::size_t queued_bytes{0};
+    std::string result;
+    std::string error;
+    bool finished{false};
+    bool closed{false};
+    bool pulling{false};
+    std::chrono::steady_clock::time_point last_pull{
+        std::chrono::steady_clock::now()
+    };
+
+    Signal data_ready;
+    Signal space_ready;
+};
+
+// Reply of MSG_STREAM_NEXT for a stream which cannot be pulled.
+std::string pack_stream_error(const std::string &error);
+
+class StreamRegistry {
+public:
+    static constexpr std::chrono::seconds IDLE_TIMEOUT{60};
+
+    // Add a session and return its id, sessions not pulled for
+    // IDLE_TIMEOUT are closed by a timer running while there are any.
+    // Returns 0 if there are already `max_sessions` sessions.
+    uint64_t add(std::shared_ptr<StreamSession> session);
+
+    // Together with MAX_QUEUED_BYTES this bounds the memory of chunks.
+    void set_max_sessions(std::size_t n) {
+        std::lock_guard<std::mutex> lg(mtx);
+        max_sessions = n;
+    }
+
+    std::shared_ptr<StreamSession> find(uint64_t id);
+
+    void erase(uint64_t id);
+
+private:
+    coke::Task<> reap();
+
+private:
+    std::mutex mtx;
+    uint64_t next_id{1};
+    std::size_t max_sessions{256};
+    bool reaping{false};
+    std::map<uint64_t, std::shared_ptr<StreamSession>> sessions;
+};
+
+} // namespace remote
+
+#endif // REMOTE_STREAM_H
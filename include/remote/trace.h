@@ -0,0 +1,65 @@
+#ifndef REMOTE_TRACE_H
+#define REMOTE_TRACE_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "msgpack.hpp"
+
+namespace remote {
+
+struct TraceSpan {
+    uint64_t trace_id;
+    uint64_t start;         // nanoseconds since epoch
+    uint64_t duration;      // nanoseconds
+    uint32_t thread;
+    std::string name;
+
+    MSGPACK_DEFINE(trace_id, start, duration, thread, name);
+};
+
+/**
+ * Spans of sampled requests, recorded into a ring buffer of each thread.
+ * Recording takes no lock, the oldest spans of a thread are overwritten once
+ * its ring is full. Spans can be read back by collect(), dump() or through
+ * the reserved remote function "remote/trace".
+ */
+class Tracer {
+public:
+    static constexpr std::size_t RING_SIZE = 4096;
+    static constexpr std::size_t NAME_SIZE = 48;
+
+    static Tracer &instance();
+
+    // Monotonic nanoseconds, to take the start and end of a span with.
+    static uint64_t now();
+
+    // Record a span taken with now(), its start is stored as wall clock time.
+    void record(uint64_t trace_id, std::string_view name,
+                uint64_t start, uint64_t end);
+
+    // Spans of `trace_id` ordered by start time, zero means all spans.
+    std::vector<TraceSpan> collect(uint64_t trace_id = 0);
+
+    // Write the spans of `trace_id` to `path` as text, one span per line.
+    bool dump(const std::string &path, uint64_t trace_id = 0);
+
+private:
+    struct Ring;
+
+    Tracer() = default;
+
+    Ring *local_ring();
+
+private:
+    std::mutex mtx;
+    std::vector<std::unique_ptr<Ring>> rings;
+};
+
+} // namespace remote
+
+#endif // REMOTE_TRACE_H
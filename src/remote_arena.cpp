@@ -0,0 +1,105 @@
+#include <memory>
+#include <new>
+
+#include "remote/arena.h"
+
+namespace remote {
+
+namespace {
+
+struct BlockCache {
+    ~BlockCache() {
+        while (head) {
+            void *p = head;
+            head = *(void **)head;
+            ::operator delete(p);
+        }
+    }
+
+    void *get() {
+        if (!head)
+            return ::operator new(Arena::BLOCK_SIZE);
+
+        void *p = head;
+        head = *(void **)head;
+        --count;
+        return p;
+    }
+
+    void put(void *p) {
+        if (count >= Arena::MAX_CACHED_BLOCKS) {
+            ::operator delete(p);
+            return;
+        }
+
+        *(void **)p = head;
+        head = p;
+        ++count;
+    }
+
+    void *head{nullptr};
+    std::size_t count{0};
+};
+
+thread_local BlockCache block_cache;
+
+// Keep the usable area of each block aligned as operator new does.
+constexpr std::size_t HEADER_SIZE = alignof(std::max_align_t);
+
+} // namespace
+
+void Arena::release() {
+    while (blocks) {
+        Block *next = blocks->next;
+        block_cache.put(blocks);
+        blocks = next;
+    }
+
+    while (large_blocks) {
+        Block *next = large_blocks->next;
+        ::operator delete(large_blocks);
+        large_blocks = next;
+    }
+
+    cur = end = nullptr;
+}
+
+void *Arena::do_allocate(std::size_t bytes, std::size_t align) {
+    void *p = cur;
+    std::size_t space = end - cur;
+
+    if (p && std::align(align, bytes, p, space)) {
+        cur = (char *)p + bytes;
+        return p;
+    }
+
+    if (bytes + align > (BLOCK_SIZE - HEADER_SIZE) / 4)
+        return allocate_large(bytes, align);
+
+    Block *block = (Block *)block_cache.get();
+    block->next = blocks;
+    blocks = block;
+
+    cur = (char *)block + HEADER_SIZE;
+    end = (char *)block + BLOCK_SIZE;
+
+    p = cur;
+    space = end - cur;
+    std::align(align, bytes, p, space);
+    cur = (char *)p + bytes;
+    return p;
+}
+
+void *Arena::allocate_large(std::size_t bytes, std::size_t align) {
+    std::size_t space = bytes + align;
+    Block *block = (Block *)::operator new(HEADER_SIZE + space);
+    void *p = (char *)block + HEADER_SIZE;
+
+    block->next = large_blocks;
+    large_blocks = block;
+
+    std::align(align, bytes, p, space);
+    return p;
+}
+
+} // namespace remote
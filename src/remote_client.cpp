@@ -17,23 +17,121 @@ public:
     }
 };
 
-coke::Task<std::pair<int,int>>
-Client::call(CommandBuilder &m) {
-    RemoteTask *task;
-    task = create_remote_task(params.host, params.port, params.retry_max);
-    task->set_send_timeout(params.send_timeout);
-    task->set_receive_timeout(params.receive_timeout);
-    task->set_keep_alive(params.keep_alive_timeout);
+// Limit a configured timeout to the remaining time budget of the call.
+static int limit_timeout(int timeout, int budget) {
+    if (budget < 0)
+        return timeout;
 
+    return (timeout < 0 || timeout > budget) ? budget : timeout;
+}
+
+static std::string pack_program(const DataMap &data,
+                                std::span<const Command> cmds,
+                                std::span<const ArgID> return_ids,
+                                const CallMeta &meta) {
     std::string msg;
     PackStream stream(msg);
+    msgpack::packer<PackStream<>> pk(stream);
+
+    pk.pack(data);
+
+    pk.pack_array(cmds.size());
+    for (const Command &cmd : cmds)
+        pk.pack(cmd);
+
+    pk.pack_array(return_ids.size());
+    for (ArgID id : return_ids)
+        pk.pack(id);
+
+    pk.pack(meta);
+    return msg;
+}
+
+static bool is_server_error(std::pair<int,int> ret) {
+    return ret.first == WFT_STATE_TASK_ERROR && ret.second == REMOTE_ERR_SERVER;
+}
+
+static int call_type(const CallMeta &meta) {
+    return meta.sampled ? (MSG_CALL | MSG_FLAG_SAMPLED) : MSG_CALL;
+}
+
+coke::Task<std::pair<int,int>>
+Client::call(CommandBuilder &m, TraceContext trace) {
+    CallMeta meta;
+    meta.trace_id = trace.trace_id;
+    meta.sampled = trace.sampled;
+    meta.timeout = params.call_timeout;
+
+    std::string reply;
+    std::string msg = pack_program(m.data, m.cmds, m.return_ids, meta);
+    auto ret = co_await request(call_type(meta), std::move(msg), meta.timeout,
+                                reply);
+
+    if (ret.first == WFT_STATE_SUCCESS)
+        m.set_response(std::move(reply));
+    else if (is_server_error(ret))
+        m.error = std::move(reply);
+
+    co_return ret;
+}
+
+coke::Task<std::pair<int,int>>
+Client::call(const DataMap &data, std::span<const Command> cmds,
+             std::span<const ArgID> return_ids, CallMeta meta,
+             DataMap &return_data, std::string *error) {
+    std::string reply;
+    std::string msg = pack_program(data, cmds, return_ids, meta);
+    auto ret = co_await request(call_type(meta), std::move(msg), meta.timeout,
+                                reply);
+
+    if (ret.first == WFT_STATE_SUCCESS) {
+        std::size_t off = 0;
+        bool referenced;
+        auto handle = msgpack::unpack(reply.data(), reply.size(), off,
+                                      referenced, unpack_reference);
+
+        return_data.clear();
+        handle.get().convert(return_data);
+    }
+    else if (is_server_error(ret) && error)
+        *error = std::move(reply);
+
+    co_return ret;
+}
+
+coke::Task<std::pair<int,int>>
+Client::open_stream(CommandBuilder &m, Stream &s) {
+    std::string reply;
+    std::string msg = pack_program(m.data, m.cmds, m.return_ids, CallMeta());
+    auto ret = co_await request(MSG_STREAM_OPEN, std::move(msg), -1, reply);
+
+    s = Stream();
+    s.status = ret;
 
-    msgpack::pack(stream, m.data);
-    msgpack::pack(stream, m.cmds);
-    msgpack::pack(stream, m.return_ids);
+    if (ret.first == WFT_STATE_SUCCESS) {
+        auto handle = msgpack::unpack(reply.data(), reply.size());
+
+        s.client = this;
+        s.builder = &m;
+        s.id = handle.get().as<uint64_t>();
+        s.done = false;
+    }
+    else if (is_server_error(ret))
+        s.error = std::move(reply);
+
+    co_return ret;
+}
+
+coke::Task<std::pair<int,int>>
+Client::request(int type, std::string msg, int budget, std::string &reply) {
+    RemoteTask *task;
+    task = create_remote_task(params.host, params.port, params.retry_max);
+    task->set_send_timeout(limit_timeout(params.send_timeout, budget));
+    task->set_receive_timeout(limit_timeout(params.receive_timeout, budget));
+    task->set_keep_alive(params.keep_alive_timeout);
 
     auto *req = task->get_req();
-    req->set_type(0);
+    req->set_type(type);
     req->set_value(std::move(msg));
 
     co_await RemoteAwaiter(task);
@@ -45,13 +143,81 @@ Client::call(CommandBuilder &m) {
         co_return std::make_pair(state, error);
 
     auto *resp = task->get_resp();
-    std::string *value = resp->get_value();
-    auto handle = msgpack::unpack(value->data(), value->size());
+    reply = std::move(*(resp->get_value()));
 
-    m.return_data.clear();
-    handle.get().convert(m.return_data);
+    if (resp->get_type() == MSG_ERROR)
+        co_return std::make_pair(WFT_STATE_TASK_ERROR, REMOTE_ERR_SERVER);
 
     co_return std::make_pair(0, 0);
 }
 
+static std::string pack_stream_id(uint64_t id) {
+    std::string msg;
+    PackStream stream(msg);
+    msgpack::pack(stream, id);
+    return msg;
+}
+
+coke::Task<bool> Stream::next() {
+    while (chunks.empty() && !done) {
+        std::string reply;
+        status = co_await client->request(MSG_STREAM_NEXT, pack_stream_id(id),
+                                          -1, reply);
+
+        if (status.first != WFT_STATE_SUCCESS) {
+            if (is_server_error(status))
+                error = std::move(reply);
+
+            done = true;
+            break;
+        }
+
+        // See StreamSession::pull for the layout of the reply.
+        std::size_t off = 0;
+        bool referenced;
+        auto handle = msgpack::unpack(reply.data(), reply.size(), off,
+                                      referenced, unpack_reference);
+        const msgpack::object &obj = handle.get();
+
+        if (obj.type != msgpack::type::ARRAY || obj.via.array.size != 4)
+            throw msgpack::type_error();
+
+        const msgpack::object *fields = obj.via.array.ptr;
+        const msgpack::object &arr = fields[0];
+
+        if (arr.type != msgpack::type::ARRAY)
+            throw msgpack::type_error();
+
+        for (uint32_t i = 0; i < arr.via.array.size; i++)
+            chunks.push_back(arr.via.array.ptr[i].as<std::string>());
+
+        done = fields[1].as<bool>();
+        if (done) {
+            error = fields[2].as<std::string>();
+            std::string result = fields[3].as<std::string>();
+
+            if (error.empty())
+                builder->set_response(std::move(result));
+        }
+    }
+
+    if (chunks.empty())
+        co_return false;
+
+    current = std::move(chunks.front());
+    chunks.pop_front();
+    co_return true;
+}
+
+coke::Task<void> Stream::close() {
+    if (done)
+        co_return;
+
+    std::string reply;
+    done = true;
+    chunks.clear();
+    status = co_await client->request(MSG_STREAM_CLOSE, pack_stream_id(id),
+                                      -1, reply);
+}
+
 } // namespace remote
@@ -0,0 +1,375 @@
+#include <algorithm>
+#include <exception>
+#include <set>
+#include <stdexcept>
+
+#include "remote/function_manager.h"
+#include "coke/basic_awaiter.h"
+#include "coke/sleep.h"
+#include "coke/wait.h"
+#include "workflow/Executor.h"
+#include "workflow/WFTask.h"
+#include "workflow/WFTaskFactory.h"
+
+namespace remote {
+
+class GoAwaiter : public coke::BasicAwaiter<void> {
+public:
+    explicit GoAwaiter(WFGoTask *task) {
+        task->set_callback([info = this->get_info()] (WFGoTask *) {
+            auto *awaiter = info->get_awaiter<GoAwaiter>();
+            awaiter->done();
+        });
+
+        this->set_task(task);
+    }
+};
+
+// Go task which runs on the executor of a BlockingPool.
+class PoolGoTask : public WFGoTask {
+public:
+    PoolGoTask(::ExecQueue *queue, Executor *executor,
+               std::function<void()> func)
+        : WFGoTask(queue, executor), func(std::move(func))
+    { }
+
+private:
+    virtual void execute() { func(); }
+
+private:
+    std::function<void()> func;
+};
+
+struct FunctionManager::BlockingPool {
+    Executor executor;
+    ::ExecQueue queue;
+};
+
+FunctionManager::FunctionManager() {
+    add("remote/trace", +[](uint64_t trace_id) {
+        return Tracer::instance().collect(trace_id);
+    });
+}
+
+FunctionManager::~FunctionManager() {
+    if (blocking_pool) {
+        blocking_pool->executor.deinit();
+        blocking_pool->queue.deinit();
+    }
+}
+
+FunctionManager::BlockingPool *FunctionManager::get_blocking_pool() {
+    std::call_once(blocking_once, [this] {
+        auto pool = std::make_unique<BlockingPool>();
+
+        if (pool->queue.init() != 0)
+            throw std::runtime_error("init blocking queue failed");
+
+        if (pool->executor.init(blocking_threads) != 0) {
+            pool->queue.deinit();
+            throw std::runtime_error("init blocking pool failed");
+        }
+
+        blocking_pool = std::move(pool);
+    });
+
+    return blocking_pool.get();
+}
+
+static int elapsed_ms(std::chrono::steady_clock::time_point start) {
+    auto d = std::chrono::steady_clock::now() - start;
+    return (int)std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+}
+
+coke::Task<void>
+FunctionManager::invoke(DataMap &data, std::span<const Command> cmds,
+                        CallMeta meta, ChunkSink sink) {
+    std::size_t x = 0;
+    std::size_t instructions = 0;
+    std::size_t limit = sink ? max_stream_instructions : max_instructions;
+
+    if (!server_name.empty()) {
+        auto it = std::find(meta.path.begin(), meta.path.end(), server_name);
+        if (it != meta.path.end())
+            throw std::runtime_error("forward loop detected");
+    }
+
+    while (x < cmds.size()) {
+        if (++instructions > limit)
+            throw std::runtime_error("instruction limit exceeded");
+
+        // Timer callbacks are queued behind the other handler thread work.
+        if (sink && instructions % STREAM_SLICE == 0)
+            co_await coke::sleep(std::chrono::nanoseconds(0));
+
+        const Command &cmd = cmds[x];
+
+        switch (cmd.type) {
+        case CMD_INVOKE:
+        {
+            if (!cmd.target.empty()) {
+                std::size_t end = co_await forward(data, cmds, x, meta);
+                instructions += end - x - 1;
+                x = end;
+                break;
+            }
+
+            auto it = func_map.find(std::string_view(cmd.name));
+            if (it == func_map.end())
+                throw std::runtime_error("function not found");
+
+            const FunctionEntry &entry = it->second;
+            ExecQueue &q = exec_queues[entry.cls];
+
+            uint64_t span_start = meta.sampled ? Tracer::now() : 0;
+
+            if (entry.cls == EXEC_INLINE) {
+                data[cmd.ret_id] = entry.func(data, cmd.arg_ids);
+                q.finished.fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+                co_await call_in_pool(entry, data, cmd);
+
+            if (meta.sampled) {
+                Tracer::instance().record(meta.trace_id, cmd.name,
+                                          span_start, Tracer::now());
+            }
+
+            ++x;
+            break;
+        }
+
+        case CMD_RETURN:
+            co_return;
+
+        case CMD_EMIT:
+            if (sink && !co_await sink(data[cmd.arg_ids[0]]))
+                throw std::runtime_error("stream closed");
+            ++x;
+            break;
+
+        case CMD_JUMP:
+            x = cmd.label;
+            break;
+
+        case CMD_JUMP_TRUE:
+            if (test(data[cmd.arg_ids[0]]))
+                x = cmd.label;
+            else
+                ++x;
+            break;
+
+        case CMD_JUMP_FALSE:
+            if (test(data[cmd.arg_ids[0]]))
+                ++x;
+            else
+                x = cmd.label;
+            break;
+
+        default:
+            //break;
+            throw std::runtime_error("unknown command type");
+        }
+    }
+}
+
+/**
+ * Run the function on the threads of its class, then go back to a network
+ * handler thread so that the rest of the program does not hold them.
+ */
+coke::Task<void>
+FunctionManager::call_in_pool(const FunctionEntry &entry, DataMap &data,
+                              const Command &cmd) {
+    ExecQueue &q = exec_queues[entry.cls];
+    std::exception_ptr eptr;
+    bool ran = false;
+
+    if (q.pending.fetch_add(1, std::memory_order_relaxed) >= q.limit) {
+        q.pending.fetch_sub(1, std::memory_order_relaxed);
+        q.rejected.fetch_add(1, std::memory_order_relaxed);
+        throw std::runtime_error("execution queue full");
+    }
+
+    auto func = [&] {
+        q.queued.fetch_sub(1, std::memory_order_relaxed);
+        q.running.fetch_add(1, std::memory_order_relaxed);
+        ran = true;
+
+        try {
+            data[cmd.ret_id] = entry.func(data, cmd.arg_ids);
+        }
+        catch (...) {
+            eptr = std::current_exception();
+        }
+
+        q.running.fetch_sub(1, std::memory_order_relaxed);
+        q.finished.fetch_add(1, std::memory_order_relaxed);
+    };
+
+    WFGoTask *task;
+    q.queued.fetch_add(1, std::memory_order_relaxed);
+
+    try {
+        if (entry.cls == EXEC_BLOCKING) {
+            BlockingPool *pool = get_blocking_pool();
+            task = new PoolGoTask(&pool->queue, &pool->executor,
+                                  std::move(func));
+        }
+        else
+            task = WFTaskFactory::create_go_task(q.name, std::move(func));
+    }
+    catch (...) {
+        q.queued.fetch_sub(1, std::memory_order_relaxed);
+        q.pending.fetch_sub(1, std::memory_order_relaxed);
+        throw;
+    }
+
+    co_await GoAwaiter(task);
+
+    if (!ran)
+        q.queued.fetch_sub(1, std::memory_order_relaxed);
+
+    q.pending.fetch_sub(1, std::memory_order_relaxed);
+
+    // Timer callbacks run on the handler threads.
+    co_await coke::sleep(std::chrono::nanoseconds(0));
+
+    if (!ran)
+        throw std::runtime_error("execution failed");
+
+    if (eptr)
+        std::rethrow_exception(eptr);
+}
+
+/**
+ * Forward the run of targeted commands starting at `pos`. Commands for the
+ * same target are packed into one sub program, and sub programs of different
+ * targets are sent in parallel. The run stops at the first command touching
+ * an arg which another target in this run also touches, so that the result
+ * does not depend on the order of execution. Returns the index of the first
+ * command not forwarded.
+ */
+coke::Task<std::size_t>
+FunctionManager::forward(DataMap &data, std::span<const Command> cmds,
+                         std::size_t pos, const CallMeta &meta) {
+    struct SubProgram {
+        Client *client{nullptr};
+        DataMap input;
+        DataMap output;
+        std::vector<Command> cmds;
+        std::set<ArgID> produced;
+        std::set<ArgID> returned;
+        std::string error;
+    };
+
+    std::map<std::string_view, SubProgram> progs;
+    std::map<ArgID, const std::pmr::string *> owner;
+    std::size_t end = pos;
+
+    auto touched_by_others = [&owner](const Command &cmd, ArgID id) {
+        auto it = owner.find(id);
+        return it != owner.end() && *(it->second) != cmd.target;
+    };
+
+    while (end < cmds.size()) {
+        const Command &cmd = cmds[end];
+        if (cmd.type != CMD_INVOKE || cmd.target.empty())
+            break;
+
+        bool conflict = touched_by_others(cmd, cmd.ret_id);
+        for (ArgID id : cmd.arg_ids)
+            conflict = conflict || touched_by_others(cmd, id);
+
+        if (conflict)
+            break;
+
+        auto sit = servers.find(std::string_view(cmd.target));
+        if (sit == servers.end())
+            throw std::runtime_error("server not found");
+
+        SubProgram &p = progs[cmd.target];
+        p.client = &(sit->second);
+
+        // Args are forwarded as a whole and returned back, because they may
+        // be modified by the downstream function through reference.
+        for (ArgID id : cmd.arg_ids) {
+            if (!p.produced.contains(id))
+                p.input[id] = data[id];
+
+            owner[id] = &(cmd.target);
+            p.returned.insert(id);
+        }
+
+        owner[cmd.ret_id] = &(cmd.target);
+        p.produced.insert(cmd.ret_id);
+        p.returned.insert(cmd.ret_id);
+
+        Command &sub = p.cmds.emplace_back(cmd);
+        sub.target.clear();
+        ++end;
+    }
+
+    if (meta.hops + 1 > MAX_FORWARD_HOPS)
+        throw std::runtime_error("too many forward hops");
+
+    CallMeta sub_meta;
+    sub_meta.hops = meta.hops + 1;
+    sub_meta.path = meta.path;
+    sub_meta.trace_id = meta.trace_id;
+    sub_meta.sampled = meta.sampled;
+
+    if (!server_name.empty())
+        sub_meta.path.push_back(server_name);
+
+    if (meta.timeout >= 0) {
+        sub_meta.timeout = meta.timeout - elapsed_ms(meta.received);
+        if (sub_meta.timeout <= 0)
+            throw std::runtime_error("deadline exceeded");
+    }
+
+    std::vector<std::vector<ArgID>> return_ids;
+    std::vector<coke::Task<std::pair<int,int>>> tasks;
+    return_ids.reserve(progs.size());
+
+    for (auto &[target, p] : progs) {
+        auto &ids = return_ids.emplace_back(p.returned.begin(),
+                                            p.returned.end());
+        tasks.push_back(p.client->call(p.input, p.cmds, ids, sub_meta,
+                                       p.output, &p.error));
+    }
+
+    uint64_t span_start = meta.sampled ? Tracer::now() : 0;
+    auto results = co_await coke::async_wait(std::move(tasks));
+
+    if (meta.sampled) {
+        Tracer::instance().record(meta.trace_id, "forward", span_start,
+                                  Tracer::now());
+    }
+
+    // Keep the error of the downstream server, so that the program can be
+    // debugged from the server which received it.
+    std::size_t i = 0;
+    for (auto &[target, p] : progs) {
+        auto [state, error] = results[i++];
+
+        if (!p.error.empty()) {
+            throw std::runtime_error("forward to " + std::string(target) +
+                                     ": " + p.error);
+        }
+
+        if (state != 0) {
+            throw std::runtime_error("forward to " + std::string(target) +
+                                     " failed, state " + std::to_string(state) +
+                                     " error " + std::to_string(error));
+        }
+    }
+
+    for (auto &[target, p] : progs) {
+        for (auto &[id, value] : p.output)
+            data[id] = std::move(value);
+    }
+
+    co_return end;
+}
+
+} // namespace remote
@@ -0,0 +1,169 @@
+#include <fstream>
+#include <sstream>
+
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "remote/server.h"
+
+namespace remote {
+
+static int create_reuseport_fd(const std::string &host, int port) {
+    struct addrinfo hints{};
+    struct addrinfo *res;
+    std::string port_str = std::to_string(port);
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    const char *node = host.empty() ? nullptr : host.c_str();
+    if (getaddrinfo(node, port_str.c_str(), &hints, &res) != 0)
+        return -1;
+
+    int fd = socket(res->ai_family, SOCK_STREAM, 0);
+    int on = 1;
+
+    if (fd >= 0) {
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) < 0 ||
+            bind(fd, res->ai_addr, res->ai_addrlen) < 0 ||
+            listen(fd, SOMAXCONN) < 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    freeaddrinfo(res);
+    return fd;
+}
+
+std::vector<int> numa_node_cpus(int node) {
+    std::string path = "/sys/devices/system/node/node" +
+                       std::to_string(node) + "/cpulist";
+    std::ifstream ifs(path);
+    std::string list, range;
+    std::vector<int> cpus;
+
+    if (!std::getline(ifs, list))
+        return cpus;
+
+    // The format is like 0-3,8-11
+    std::istringstream iss(list);
+    while (std::getline(iss, range, ',')) {
+        auto dash = range.find('-');
+        int first = std::stoi(range);
+        int last = dash == std::string::npos ? first
+                                             : std::stoi(range.substr(dash + 1));
+
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+
+    return cpus;
+}
+
+ServerGroup::Listener::Listener(ServerGroup *group,
+                               const RemoteServerParams &params)
+    : server(params, [group, this] (RemoteServerContext ctx) {
+        return group->process(this, std::move(ctx));
+    })
+{ }
+
+ServerGroup::ServerGroup(const RemoteServerParams &params,
+                         ProcessorType co_proc, const ListenerParams &lparams)
+    : co_proc(std::move(co_proc)), cpus(lparams.cpus)
+{
+    int n = lparams.listeners > 0 ? lparams.listeners : 1;
+
+    for (int i = 0; i < n; i++)
+        listeners.push_back(std::make_unique<Listener>(this, params));
+}
+
+int ServerGroup::start(const std::string &host, int port) {
+    for (started = 0; started < listeners.size(); started++) {
+        int fd = create_reuseport_fd(host, port);
+        if (fd < 0)
+            break;
+
+        if (listeners[started]->server.serve(fd) != 0) {
+            close(fd);
+            break;
+        }
+    }
+
+    if (started == listeners.size())
+        return 0;
+
+    shutdown();
+    wait_finish();
+    return -1;
+}
+
+void ServerGroup::shutdown() {
+    for (std::size_t i = 0; i < started; i++)
+        listeners[i]->server.shutdown();
+}
+
+void ServerGroup::wait_finish() {
+    for (std::size_t i = 0; i < started; i++)
+        listeners[i]->server.wait_finish();
+
+    started = 0;
+}
+
+std::vector<ListenerStat> ServerGroup::get_stats() const {
+    std::vector<ListenerStat> stats;
+
+    for (const auto &l : listeners) {
+        stats.push_back(ListenerStat{
+            .requests       = l->requests.load(std::memory_order_relaxed),
+            .active         = l->active.load(std::memory_order_relaxed),
+            .connections    = l->server.get_conn_count(),
+        });
+    }
+
+    return stats;
+}
+
+// Whether this handler thread is pinned, by any group of the process.
+static thread_local bool thread_pinned = false;
+
+/**
+ * Handler threads are shared by all servers in the process, so they are
+ * pinned round robin over the whole cpu set rather than per listener, and
+ * a thread keeps the cpu of the first group which pinned it.
+ */
+void ServerGroup::pin_thread() {
+    if (thread_pinned || cpus.empty())
+        return;
+
+    std::size_t n = pinned_threads.fetch_add(1, std::memory_order_relaxed);
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpus[n % cpus.size()], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    thread_pinned = true;
+}
+
+coke::Task<> ServerGroup::process(Listener *l, RemoteServerContext ctx) {
+    struct ActiveGuard {
+        ~ActiveGuard() { active.fetch_sub(1, std::memory_order_relaxed); }
+        std::atomic<std::size_t> &active;
+    };
+
+    pin_thread();
+
+    l->requests.fetch_add(1, std::memory_order_relaxed);
+    l->active.fetch_add(1, std::memory_order_relaxed);
+    ActiveGuard guard{l->active};
+
+    co_await co_proc(std::move(ctx));
+}
+
+} // namespace remote
@@ -0,0 +1,171 @@
+#include "remote/stream.h"
+#include "coke/sleep.h"
+
+namespace remote {
+
+coke::Task<bool> StreamSession::push(std::string chunk) {
+    std::unique_lock<std::mutex> lk(mtx);
+
+    while (queued_bytes >= MAX_QUEUED_BYTES && !closed) {
+        Signal signal = space_ready = std::make_shared<coke::Latch>(1);
+        lk.unlock();
+        co_await signal->wait();
+        lk.lock();
+    }
+
+    if (closed)
+        co_return false;
+
+    queued_bytes += chunk.size();
+    chunks.push_back(std::move(chunk));
+    wake(data_ready);
+
+    co_return true;
+}
+
+void StreamSession::finish(std::string result, std::string error) {
+    std::lock_guard<std::mutex> lg(mtx);
+
+    this->result = std::move(result);
+    this->error = std::move(error);
+    finished = true;
+    wake(data_ready);
+}
+
+/**
+ * The reply is an array of
+ *   chunks  array of packed values
+ *   done    bool
+ *   error   str, empty unless the program failed
+ *   result  str, the packed return values once done
+ */
+coke::Task<std::string> StreamSession::pull(bool &done) {
+    std::unique_lock<std::mutex> lk(mtx);
+
+    // Two pulls at once, such as a retried one, cannot agree on which chunks
+    // are delivered, so the stream ends for both of them.
+    if (pulling) {
+        closed = true;
+        wake(data_ready);
+        wake(space_ready);
+
+        done = true;
+        co_return pack_stream_error("stream pulled concurrently");
+    }
+
+    pulling = true;
+
+    while (chunks.empty() && !finished && !closed) {
+        Signal signal = data_ready = std::make_shared<coke::Latch>(1);
+        lk.unlock();
+        co_await signal->wait();
+        lk.lock();
+    }
+
+    std::size_t n = 0, bytes = 0;
+    while (n < chunks.size() && (n == 0 || bytes < MAX_BATCH_BYTES))
+        bytes += chunks[n++].size();
+
+    done = (n == chunks.size()) && (finished || closed);
+
+    std::string reply;
+    PackStream stream(reply);
+    msgpack::packer<PackStream<>> pk(stream);
+
+    pk.pack_array(4);
+    pk.pack_array(n);
+    for (std::size_t i = 0; i < n; i++)
+        pk.pack(chunks[i]);
+
+    pk.pack(done);
+    pk.pack(done ? error : std::string());
+    pk.pack(done ? result : std::string());
+
+    chunks.erase(chunks.begin(), chunks.begin() + n);
+    queued_bytes -= bytes;
+    wake(space_ready);
+
+    pulling = false;
+    last_pull = std::chrono::steady_clock::now();
+
+    co_return reply;
+}
+
+void StreamSession::close() {
+    std::lock_guard<std::mutex> lg(mtx);
+
+    closed = true;
+    wake(data_ready);
+    wake(space_ready);
+}
+
+bool StreamSession::idle_for(std::chrono::steady_clock::duration d) {
+    std::lock_guard<std::mutex> lg(mtx);
+    return !pulling && std::chrono::steady_clock::now() - last_pull > d;
+}
+
+std::string pack_stream_error(const std::string &error) {
+    std::string reply;
+    PackStream stream(reply);
+    msgpack::packer<PackStream<>> pk(stream);
+
+    pk.pack_array(4);
+    pk.pack_array(0);
+    pk.pack(true);
+    pk.pack(error);
+    pk.pack(std::string());
+
+    return reply;
+}
+
+uint64_t StreamRegistry::add(std::shared_ptr<StreamSession> session) {
+    std::lock_guard<std::mutex> lg(mtx);
+
+    if (sessions.size() >= max_sessions)
+        return 0;
+
+    uint64_t id = next_id++;
+    sessions.emplace(id, std::move(session));
+
+    if (!reaping) {
+        reaping = true;
+        coke::detach(reap());
+    }
+
+    return id;
+}
+
+coke::Task<> StreamRegistry::reap() {
+    while (true) {
+        co_await coke::sleep(IDLE_TIMEOUT / 2);
+
+        std::lock_guard<std::mutex> lg(mtx);
+
+        for (auto it = sessions.begin(); it != sessions.end(); ) {
+            if (it->second->idle_for(IDLE_TIMEOUT)) {
+                it->second->close();
+                it = sessions.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        if (sessions.empty()) {
+            reaping = false;
+            co_return;
+        }
+    }
+}
+
+std::shared_ptr<StreamSession> StreamRegistry::find(uint64_t id) {
+    std::lock_guard<std::mutex> lg(mtx);
+    auto it = sessions.find(id);
+    return it == sessions.end() ? nullptr : it->second;
+}
+
+void StreamRegistry::erase(uint64_t id) {
+    std::lock_guard<std::mutex> lg(mtx);
+    sessions.erase(id);
+}
+
+} // namespace remote
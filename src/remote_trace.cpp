@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+
+#include "remote/trace.h"
+
+namespace remote {
+
+/**
+ * Single writer ring. Each slot is guarded by a sequence number, which is
+ * odd while the writer fills the slot, so readers on other threads can skip
+ * slots being overwritten.
+ */
+struct Tracer::Ring {
+    struct Slot {
+        std::atomic<uint64_t> seq{0};
+        uint64_t trace_id;
+        uint64_t start;
+        uint64_t duration;
+        char name[NAME_SIZE];
+    };
+
+    uint32_t thread;
+    std::atomic<uint64_t> head{0};
+    std::array<Slot, RING_SIZE> slots;
+};
+
+Tracer &Tracer::instance() {
+    static Tracer tracer;
+    return tracer;
+}
+
+template<typename Clock>
+static uint64_t clock_ns() {
+    auto d = Clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+}
+
+uint64_t Tracer::now() {
+    return clock_ns<std::chrono::steady_clock>();
+}
+
+Tracer::Ring *Tracer::local_ring() {
+    thread_local Ring *ring = nullptr;
+
+    if (!ring) {
+        auto r = std::make_unique<Ring>();
+        std::lock_guard<std::mutex> lg(mtx);
+
+        r->thread = (uint32_t)rings.size();
+        ring = r.get();
+        rings.push_back(std::move(r));
+    }
+
+    return ring;
+}
+
+void Tracer::record(uint64_t trace_id, std::string_view name,
+                    uint64_t start, uint64_t end) {
+    Ring *ring = local_ring();
+    uint64_t h = ring->head.load(std::memory_order_relaxed);
+    Ring::Slot &slot = ring->slots[h % RING_SIZE];
+    std::size_t len = std::min(name.size(), NAME_SIZE - 1);
+
+    slot.seq.store(h * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // Durations come from the steady clock only, the system clock may jump.
+    slot.trace_id = trace_id;
+    slot.start = clock_ns<std::chrono::system_clock>() - (now() - start);
+    slot.duration = end - start;
+    std::memcpy(slot.name, name.data(), len);
+    slot.name[len] = '\0';
+
+    slot.seq.store(h * 2 + 2, std::memory_order_release);
+    ring->head.store(h + 1, std::memory_order_relaxed);
+}
+
+std::vector<TraceSpan> Tracer::collect(uint64_t trace_id) {
+    std::vector<TraceSpan> spans;
+    std::lock_guard<std::mutex> lg(mtx);
+
+    for (const auto &ring : rings) {
+        for (const Ring::Slot &slot : ring->slots) {
+            uint64_t seq = slot.seq.load(std::memory_order_acquire);
+            if (seq == 0 || seq % 2 == 1)
+                continue;
+
+            TraceSpan span;
+            char name[NAME_SIZE];
+
+            span.trace_id = slot.trace_id;
+            span.start = slot.start;
+            span.duration = slot.duration;
+            span.thread = ring->thread;
+            std::memcpy(name, slot.name, NAME_SIZE);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) != seq)
+                continue;
+
+            if (trace_id != 0 && span.trace_id != trace_id)
+                continue;
+
+            name[NAME_SIZE - 1] = '\0';
+            span.name = name;
+            spans.push_back(std::move(span));
+        }
+    }
+
+    std::sort(spans.begin(), spans.end(), [] (const auto &a, const auto &b) {
+        return a.start < b.start;
+    });
+
+    return spans;
+}
+
+bool Tracer::dump(const std::string &path, uint64_t trace_id) {
+    std::ofstream ofs(path, std::ios::app);
+    if (!ofs)
+        return false;
+
+    for (const TraceSpan &span : collect(trace_id)) {
+        ofs << span.trace_id << ' ' << span.thread << ' ' << span.start << ' '
+            << span.duration << ' ' << span.name << '\n';
+    }
+
+    return (bool)ofs;
+}
+
+} // namespace remote